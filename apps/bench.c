@@ -0,0 +1,259 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../io/File.h"
+#include "../disk/diskIO.h"
+
+/* Benchmarks of the LLFS API on a scratch disk, one workload after the other:
+     churn    create/delete files in one directory
+     lookup   get_size of a file 16 directories deep
+     append   small appends to a few files
+     seqread  whole-file reads of 1 MB files
+     mixed    reads, appends, lookups, creates and deletes together
+   Every operation is timed, the report gives ops/s and the p50/p99/p999 latencies.
+   The random choices come from a fixed seed, so two runs do the same operations.
+   usage: ./bench [--csv | --json] [--seed N] [--ops N] [workload...] */
+
+#define BENCH_VDISK "bench_vdisk"
+#define CHURN_FILES 512  // names churn picks from
+#define LOOKUP_DEPTH 16
+#define APPEND_FILES 16
+#define APPEND_SIZE 64
+#define READ_FILES 8
+#define READ_SIZE (1 << 20)
+
+typedef struct Result Result;
+struct Result {
+    char*  workload;
+    int    ops;
+    int    errors;
+    double seconds;
+    double p50, p99, p999, max; // microseconds
+};
+
+typedef struct Bench Bench;
+struct Bench {
+    LLFS*        fs;
+    unsigned int seed;
+    int          ops;
+    double*      latencies; // one per operation of the current workload
+    char*        buffer;    // READ_SIZE
+    char         exists[CHURN_FILES];
+};
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned int next_random(unsigned int* seed)
+{
+    *seed ^= *seed << 13; // xorshift32
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+static int compare(const void* a, const void* b)
+{
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(double* sorted, int count, double p)
+{
+    int i = (int) (p * count);
+    return sorted[i < count ? i : count - 1];
+}
+
+/* --- The operations, each returns 0 if the call failed --- */
+
+static int churn_op(Bench* b)
+{
+    int n = next_random(&b->seed) % CHURN_FILES;
+    char name[16];
+    sprintf(name, "c%d", n);
+    int ok = b->exists[n] ? LLFS_Rm(b->fs, name, "/churn") : LLFS_Touch(b->fs, name, "/churn");
+    b->exists[n] = !b->exists[n];
+    return ok != 0;
+}
+
+static char deep_path[LOOKUP_DEPTH * 4 + 2];
+
+static int lookup_op(Bench* b)
+{
+    return LLFS_get_size(b->fs, "leaf", deep_path) == APPEND_SIZE;
+}
+
+static int append_op(Bench* b)
+{
+    char name[16];
+    sprintf(name, "a%u", next_random(&b->seed) % APPEND_FILES);
+    return LLFS_Write(b->fs, name, b->buffer, APPEND_SIZE, "/append") != 0;
+}
+
+static int seqread_op(Bench* b)
+{
+    char name[16];
+    sprintf(name, "r%u", next_random(&b->seed) % READ_FILES);
+    return LLFS_Read(b->fs, name, b->buffer, READ_SIZE, "/read") != 0;
+}
+
+static int mixed_op(Bench* b)
+{
+    unsigned int r = next_random(&b->seed) % 10;
+    if (r < 4) {
+        char name[16];
+        sprintf(name, "r%u", next_random(&b->seed) % READ_FILES);
+        int offset = (next_random(&b->seed) % (READ_SIZE / 4096)) * 4096;
+        return LLFS_ReadAt(b->fs, name, b->buffer, 4096, offset, "/read") == 4096;
+    }
+    if (r < 6) return append_op(b);
+    if (r < 8) return lookup_op(b);
+    return churn_op(b);
+}
+
+/* --- Setup and the runs --- */
+
+static int setup(Bench* b)
+{
+    if (!FormatLLFS(BENCH_VDISK, 4096, 32768, 4096)) return 0;
+    b->fs = MountLLFS(BENCH_VDISK);
+    if (b->fs == NULL) return 0;
+    LLFS* fs = b->fs;
+    char name[16];
+
+    LLFS_Mkdir(fs, "churn", "/");
+    LLFS_Mkdir(fs, "append", "/");
+    LLFS_Mkdir(fs, "read", "/");
+    for (int i = 0; i < APPEND_FILES; i++) {
+        sprintf(name, "a%d", i);
+        LLFS_Touch(fs, name, "/append");
+    }
+
+    strcpy(deep_path, "/");
+    for (int i = 0; i < LOOKUP_DEPTH; i++) {
+        sprintf(name, "d%d", i);
+        LLFS_Mkdir(fs, name, deep_path);
+        if (i > 0) strcat(deep_path, "/");
+        strcat(deep_path, name);
+    }
+    LLFS_Touch(fs, "leaf", deep_path);
+
+    for (int i = 0; i < READ_SIZE; i++) b->buffer[i] = (char) (i * 7);
+    LLFS_Write(fs, "leaf", b->buffer, APPEND_SIZE, deep_path);
+    for (int i = 0; i < READ_FILES; i++) {
+        sprintf(name, "r%d", i);
+        LLFS_Touch(fs, name, "/read");
+        LLFS_Write(fs, name, b->buffer, READ_SIZE, "/read");
+    }
+    LLFS_Sync(fs);
+    return 1;
+}
+
+static Result run(Bench* b, char* workload, int (*op)(Bench*), int ops)
+{
+    Result result = { workload, ops, 0, 0, 0, 0, 0, 0 };
+    double start = now();
+    for (int i = 0; i < ops; i++) {
+        double t = now();
+        if (!op(b)) result.errors++;
+        b->latencies[i] = (now() - t) * 1e6;
+    }
+    result.seconds = now() - start;
+
+    qsort(b->latencies, ops, sizeof(double), compare);
+    result.p50 = percentile(b->latencies, ops, 0.5);
+    result.p99 = percentile(b->latencies, ops, 0.99);
+    result.p999 = percentile(b->latencies, ops, 0.999);
+    result.max = b->latencies[ops - 1];
+    return result;
+}
+
+static void report(Result* results, int count, char* format)
+{
+    if (strcmp(format, "csv") == 0) {
+        printf("workload,ops,errors,seconds,ops_per_sec,p50_us,p99_us,p999_us,max_us\n");
+        for (int i = 0; i < count; i++) {
+            Result* r = &results[i];
+            printf("%s,%d,%d,%.6f,%.1f,%.2f,%.2f,%.2f,%.2f\n", r->workload, r->ops, r->errors, r->seconds,
+                   r->ops / r->seconds, r->p50, r->p99, r->p999, r->max);
+        }
+    } else if (strcmp(format, "json") == 0) {
+        printf("[\n");
+        for (int i = 0; i < count; i++) {
+            Result* r = &results[i];
+            printf("  {\"workload\": \"%s\", \"ops\": %d, \"errors\": %d, \"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+                   "\"p50_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f, \"max_us\": %.2f}%s\n",
+                   r->workload, r->ops, r->errors, r->seconds, r->ops / r->seconds,
+                   r->p50, r->p99, r->p999, r->max, (i < count - 1) ? "," : "");
+        }
+        printf("]\n");
+    } else {
+        printf("%-8s %8s %12s %10s %10s %10s %10s %7s\n", "workload", "ops", "ops/s", "p50 us", "p99 us", "p999 us", "max us", "errors");
+        for (int i = 0; i < count; i++) {
+            Result* r = &results[i];
+            printf("%-8s %8d %12.0f %10.2f %10.2f %10.2f %10.2f %7d\n", r->workload, r->ops, r->ops / r->seconds,
+                   r->p50, r->p99, r->p999, r->max, r->errors);
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    char* names[] = { "churn", "lookup", "append", "seqread", "mixed" };
+    int (*ops[])(Bench*) = { churn_op, lookup_op, append_op, seqread_op, mixed_op };
+    int scale[] = { 1, 1, 1, 64, 1 }; // seqread moves 1 MB per operation, it does fewer
+    int num_workloads = sizeof(names) / sizeof(char*);
+
+    char* format = "text";
+    unsigned int seed = 2019;
+    int num_ops = 20000;
+    int selected[5] = { 0 }, any = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--csv") == 0) format = "csv";
+        else if (strcmp(argv[i], "--json") == 0) format = "json";
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) seed = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc) num_ops = atoi(argv[++i]);
+        else {
+            int w;
+            for (w = 0; w < num_workloads && strcmp(argv[i], names[w]) != 0; w++);
+            if (w == num_workloads) {
+                fprintf(stderr, "%s\n", "usage: ./bench [--csv | --json] [--seed N] [--ops N] [churn lookup append seqread mixed]");
+                return 1;
+            }
+            selected[w] = any = 1;
+        }
+    }
+    if (num_ops < 1 || seed == 0) {
+        fprintf(stderr, "%s\n", "--ops and --seed must be positive");
+        return 1;
+    }
+
+    Bench b;
+    memset(&b, 0, sizeof(b));
+    b.seed = seed;
+    b.latencies = (double*) malloc(num_ops * sizeof(double));
+    b.buffer = (char*) malloc(READ_SIZE);
+    if (!setup(&b)) return 1;
+
+    Result results[5];
+    int count = 0, errors = 0;
+    for (int w = 0; w < num_workloads; w++) {
+        if (any && !selected[w]) continue;
+        int n = (num_ops / scale[w] > 0) ? num_ops / scale[w] : 1;
+        results[count] = run(&b, names[w], ops[w], n);
+        errors += results[count++].errors;
+    }
+    report(results, count, format);
+
+    UnmountLLFS(b.fs);
+    remove(BENCH_VDISK);
+    free(b.latencies);
+    free(b.buffer);
+    return errors ? 1 : 0;
+}
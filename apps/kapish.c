@@ -3,19 +3,22 @@
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <pwd.h>
 #include "../io/File.h"
 #include "../disk/diskIO.h"
+#include "../perf/stats.h"
+#include "../perf/trace.h"
 
-#define INPUT_SIZE 512
-#define MAX_WORDS 20
+#define INPUT_SIZE 2048
+#define MAX_WORDS 512 // touch and rm take many names
 #define WORD_SIZE 50
 #define TEST_FILE "tests.txt"
 
-void _init(int argc, char** argv);
+void _init_disk(int argc, char** argv);
 void _touch(int argc, char** argv);
 void _rm(int argc, char** argv);
 void _mkdir(int argc, char** argv);
@@ -24,6 +27,15 @@ void _append(int argc, char** argv);
 void _cat(int argc, char** argv);
 void _ls(int argc, char** argv);
 void _clear(int argc, char** argv);
+void _stats(int argc, char** argv);
+void _trace(int argc, char** argv);
+void _fsck(int argc, char** argv);
+void _mount(int argc, char** argv);
+void _sync(int argc, char** argv);
+void _crash(int argc, char** argv);
+void _damage(int argc, char** argv);
+void _readat(int argc, char** argv);
+void _writeat(int argc, char** argv);
 
 char* command_str[] = {
     "init",
@@ -34,10 +46,19 @@ char* command_str[] = {
     "append",
     "cat",
     "ls",
-    "clear"
+    "clear",
+    "stats",
+    "trace",
+    "fsck",
+    "mount",
+    "sync",
+    "crash",
+    "damage",
+    "readat",
+    "writeat"
 };
 void (*command_func[]) (int, char**) = {
-    &_init,
+    &_init_disk,
     &_touch,
     &_rm,
     &_mkdir,
@@ -45,55 +66,98 @@ void (*command_func[]) (int, char**) = {
     &_append,
     &_cat,
     &_ls,
-    &_clear
+    &_clear,
+    &_stats,
+    &_trace,
+    &_fsck,
+    &_mount,
+    &_sync,
+    &_crash,
+    &_damage,
+    &_readat,
+    &_writeat
 };
 int num_commands()
 {
     return sizeof(command_str) / sizeof(char*);
 }
 
-void _init(int argc, char** argv)
+LLFS* fs = NULL; // the disk, mounted once for the whole session
+int backend = DEFAULT_BACKEND; // what mount and crash mount it with
+int problems = 0; // found by fsck without -r, ./kapish --test fails if there are any
+
+int mounted()
+{
+    if (fs == NULL) fprintf(stderr, "%s\n", "No disk mounted, run init first.");
+    return fs != NULL;
+}
+
+void _init_disk(int argc, char** argv)
 {
-    InitLLFS();
+    int block_size = (argc > 1) ? atoi(argv[1]) : DEFAULT_BLOCK_SIZE;
+    int num_blocks = (argc > 2) ? atoi(argv[2]) : DEFAULT_NUM_BLOCKS;
+    int num_inodes = (argc > 3) ? atoi(argv[3]) : DEFAULT_NUM_INODES;
+
+    UnmountLLFS(fs);
+    fs = NULL;
+    if (InitLLFS(block_size, num_blocks, num_inodes) == 0) {
+        fprintf(stdout, "usage: init [block size] [number of blocks] [number of inodes]\n");
+        return;
+    }
+    fs = MountLLFSWith(PATH_TO_VDISK, backend);
 }
 
 void _touch(int argc, char** argv)
 {
-    if (argc == 1 || argc == 2) fprintf(stdout, "usage: touch [file name] [path]\n");
-    else if (Touch(argv[1], argv[2]) == 0) fprintf(stderr, "%s\n", "Create file unsuccessful.");
+    if (argc == 1 || argc == 2) fprintf(stdout, "usage: touch [file name...] [path]\n");
+    else if (!mounted()) return;
+    else if (argc == 3) {
+        if (LLFS_Touch(fs, argv[1], argv[2]) == 0) fprintf(stderr, "%s\n", "Create file unsuccessful.");
+    } else {
+        /* several names, the path is the last word */
+        int created = LLFS_TouchMany(fs, argv + 1, argc - 2, argv[argc - 1]);
+        if (created < argc - 2) fprintf(stderr, "Created %d of %d files.\n", created, argc - 2);
+    }
 }
 
 void _rm(int argc, char** argv)
 {
-    if (argc == 1 || argc == 2) fprintf(stdout, "usage: rm [file name] [path]\n");
-    else if (Rm(argv[1], argv[2]) == 0) fprintf(stderr, "%s\n", "Remove file unsuccessful.");
+    if (argc == 1 || argc == 2) fprintf(stdout, "usage: rm [file name...] [path]\n");
+    else if (!mounted()) return;
+    else if (argc == 3) {
+        if (LLFS_Rm(fs, argv[1], argv[2]) == 0) fprintf(stderr, "%s\n", "Remove file unsuccessful.");
+    } else {
+        int removed = LLFS_RmMany(fs, argv + 1, argc - 2, argv[argc - 1]);
+        if (removed < argc - 2) fprintf(stderr, "Removed %d of %d files.\n", removed, argc - 2);
+    }
 }
 
 void _mkdir(int argc, char** argv)
 {
     if (argc == 1 || argc == 2) fprintf(stdout, "usage: mkdir [directory name] [path]\n");
-    else if (Mkdir(argv[1], argv[2]) == 0) fprintf(stderr, "%s\n", "Create directory unsuccessful.");
+    else if (!mounted()) return;
+    else if (LLFS_Mkdir(fs, argv[1], argv[2]) == 0) fprintf(stderr, "%s\n", "Create directory unsuccessful.");
 }
 
 void _rmdir(int argc, char** argv)
 {
     if (argc == 1 || argc == 2) fprintf(stdout, "usage: rmdir [directory name] [path]\n");
-    else if (Rmdir(argv[1], argv[2]) == 0) fprintf(stderr, "%s\n", "Remove directory unsuccessful.");
+    else if (!mounted()) return;
+    else if (LLFS_Rmdir(fs, argv[1], argv[2]) == 0) fprintf(stderr, "%s\n", "Remove directory unsuccessful.");
+}
+
+int print_chunk(void* out, char* chunk, int length)
+{
+    return fwrite(chunk, 1, length, (FILE*) out) == length;
 }
 
 void _cat(int argc, char** argv)
 {
     if (argc == 1 || argc == 2) fprintf(stdout, "usage: cat [file name] [path]\n");
+    else if (!mounted()) return;
     else {
-        int file_size = get_size(argv[1], argv[2]);
-        char* buffer = (char*) malloc(file_size);
-        int rv = Read(argv[1], buffer, file_size, argv[2]);
-        if (rv == 0) fprintf(stderr, "%s\n", "Read file unsuccessful.");
-        else {
-            for(int i = 0; i < file_size; i++) printf("%c", buffer[i]);
-            printf("\n");
-        }
-        free(buffer);
+        if (LLFS_ReadStream(fs, argv[1], argv[2], print_chunk, stdout) == 0) fprintf(stderr, "%s\n", "Read file unsuccessful.");
+        else printf("\n");
     }
 }
 
@@ -101,62 +165,53 @@ void _append(int argc, char** argv)
 {
     if (argc == 1 || argc == 2 || argc == 3)
         fprintf(stdout, "usage: append [src file name] [dest file name] [path]\n");
+    else if (!mounted()) return;
     else {
-        FILE* fp = fopen(argv[1], "rb");
-        if (fp == NULL) {
+        /* streamed, the file is read ahead while the previous part is written */
+        int fd = open(argv[1], O_RDONLY);
+        if (fd < 0) {
             fprintf(stderr, "File named %s not found.\n", argv[1]);
             return;
         }
-        fseek(fp, 0, SEEK_END);
-        int size = ftell(fp);
-        char* content = (char*) malloc(size);
-        fseek(fp, 0, SEEK_SET);
-        fread(content, size, 1, fp);
-        int rv = Write(argv[2], content, size, argv[3]);
-        if (rv == 0) fprintf(stderr, "%s\n", "Write file unsuccessful.");
-        free(content);
-        fclose(fp);
+        if (LLFS_AppendFromFd(fs, argv[2], argv[3], fd) == 0) fprintf(stderr, "%s\n", "Write file unsuccessful.");
+        close(fd);
     }
 }
 
 void _ls(int argc, char** argv)
 {
-    if (argc == 1) {
-
-        FILE* disk = fopen(PATH_TO_VDISK, "rb+");
-        char* inodeBuffer = (char*) malloc(BLOCK_SIZE);
-        int file_size;
-        readBlock(disk, ROOT_INODE, inodeBuffer);
-        memcpy(&file_size, inodeBuffer, 4);
-
-        char* buffer = (char*) malloc(file_size);
-        readFromFile(disk, buffer, ROOT_INODE, file_size); // assuming root has inode_id 2
-        for(int i = 0; i < file_size; i++) {
-            if (buffer[i] == '\0') printf(" ");
-            else                   printf("%c", buffer[i]);
-        }
-        printf("\n");
-
-        free(inodeBuffer);
-        free(buffer);
-        fclose(disk);
+    /* ls [-l] [directory name] [path], the root directory without a name */
+    int details = argc > 1 && strcmp(argv[1], "-l") == 0;
+    if (details) {
+        argv++;
+        argc--;
+    }
+    if (argc == 2) {
+        fprintf(stdout, "usage: ls [-l] [directory name] [path] (to read root, just type ls)\n");
+        return;
+    }
+    if (!mounted()) return;
 
-    } else if (argc == 2)
-        fprintf(stdout, "usage: ls [directory name] [path] (to read root, just type ls)\n");
-    else {
-        int file_size = get_size(argv[1], argv[2]);
-        char* buffer = (char*) malloc(file_size);
-        int rv = Read(argv[1], buffer, file_size, argv[2]);
-        if (rv == 0) fprintf(stderr, "%s\n", "Read directory unsuccessful.");
-        else {
-            for(int i = 0; i < file_size; i++) {
-                if (buffer[i] == '\0') printf(" ");
-                else                   printf("%c", buffer[i]);
-            }
-            printf("\n");
+    char dir_path[2 * INPUT_SIZE] = "/";
+    if (argc > 2) {
+        int slash = argv[2][strlen(argv[2]) - 1] == '/';
+        snprintf(dir_path, sizeof(dir_path), "%s%s%s", argv[2], slash ? "" : "/", argv[1]);
+    }
+    LLFSDir* dir = LLFS_OpenDir(fs, dir_path, details);
+    if (dir == NULL) {
+        fprintf(stderr, "%s\n", "Read directory unsuccessful.");
+        return;
+    }
+    LLFSDirEntry entries[64];
+    int count;
+    while ((count = LLFS_ReadDir(dir, entries, 64)) > 0) {
+        for (int i = 0; i < count; i++) {
+            if (details) printf("%c %10d %s\n", entries[i].type == 0 ? 'd' : '-', entries[i].size, entries[i].name);
+            else printf("%s ", entries[i].name);
         }
-        free(buffer);
     }
+    if (!details) printf("\n");
+    LLFS_CloseDir(dir);
 }
 
 void _clear(int argc, char** argv)
@@ -252,7 +307,10 @@ void wait_for_command()
         printf("? ");
 
         line = read_input(NULL);
-        if (line == NULL) exit(0); /* Control D or exit detected */
+        if (line == NULL) { /* Control D or exit detected */
+            UnmountLLFS(fs);
+            exit(0);
+        }
         if (strlen(line) == 0) continue; /* Empty input */
 
         tokens = tokenize(line, &num_words);
@@ -311,6 +369,7 @@ void test_commands()
 
 int main(int argc, char** argv)
 {
+    fs = MountLLFSWith(PATH_TO_VDISK, backend); // NULL until the disk is initialized
     if (argc == 2)
     {
         if (strncmp(argv[1], "--test", 7) == 0) test_commands();
@@ -318,5 +377,139 @@ int main(int argc, char** argv)
     }
     else if (argc > 2) fprintf(stdout, "usage: ./kapish (or ./kapish --test)\n");
     else wait_for_command();
-    return 0;
+    UnmountLLFS(fs);
+    return problems > 0;
+}
+
+void _stats(int argc, char** argv)
+{
+    /* The I/O counters by API entry point since the last reset */
+    if (argc == 1) stats_print(stdout, 0);
+    else if (strcmp(argv[1], "json") == 0) stats_print(stdout, 1);
+    else if (strcmp(argv[1], "reset") == 0) stats_reset();
+    else fprintf(stdout, "usage: stats [reset | json]\n");
+}
+
+void _trace(int argc, char** argv)
+{
+    /* Spans of the internal functions, dumped as Chrome trace events */
+    if (argc == 2 && strcmp(argv[1], "start") == 0) trace_start();
+    else if (argc == 2 && strcmp(argv[1], "stop") == 0) trace_stop();
+    else if (argc == 3 && strcmp(argv[1], "dump") == 0) {
+        int count = trace_dump(argv[2]);
+        if (count >= 0) fprintf(stdout, "%d events written to %s\n", count, argv[2]);
+    } else fprintf(stdout, "usage: trace start | trace stop | trace dump [file.json]\n");
+}
+
+void _fsck(int argc, char** argv)
+{
+    /* The full consistency check, -r repairs what it can */
+    int repair = argc == 2 && strcmp(argv[1], "-r") == 0;
+    if (argc > 2 || (argc == 2 && !repair)) {
+        fprintf(stdout, "usage: fsck [-r]\n");
+        return;
+    }
+    if (!mounted()) return;
+    int found = LLFS_Fsck(fs, repair);
+    if (found == 0) fprintf(stdout, "No problems found\n");
+    else fprintf(stdout, "%d problem(s) found%s\n", found, repair ? ", repaired what could be" : "");
+    if (!repair) problems += found; // with -r they're expected, the disk was damaged on purpose
+}
+
+void _mount(int argc, char** argv)
+{
+    /* Unmount and mount again, with the block cache in front of pread/pwrite or of a mapping */
+    if (argc == 2 && strcmp(argv[1], "cached") == 0) backend = DISK_CACHED;
+    else if (argc == 2 && strcmp(argv[1], "mmap") == 0) backend = DISK_MMAP;
+    else if (argc != 1) {
+        fprintf(stdout, "usage: mount [cached | mmap]\n");
+        return;
+    }
+    UnmountLLFS(fs);
+    fs = MountLLFSWith(PATH_TO_VDISK, backend);
+}
+
+void _sync(int argc, char** argv)
+{
+    /* Commit what's pending, then the journal starts over */
+    if (mounted()) LLFS_Sync(fs);
+}
+
+void _crash(int argc, char** argv)
+{
+    /* Lose everything that isn't on the disk and mount again (the journal is replayed),
+       or with a number, let the disk fail after that many more commits */
+    if (argc > 2 || (argc == 2 && atoi(argv[1]) <= 0)) {
+        fprintf(stdout, "usage: crash [commits]\n");
+        return;
+    }
+    if (!mounted()) return;
+    if (argc == 2) {
+        LLFS_CrashAfter(fs, atoi(argv[1]));
+        return;
+    }
+    AbandonLLFS(fs);
+    fs = MountLLFSWith(PATH_TO_VDISK, backend);
+}
+
+void _damage(int argc, char** argv)
+{
+    /* Overwrite a block of the vdisk with 0xFF bytes behind the file system's back, for fsck
+       to find. The disk is let go first (like crash) and mounted again after. */
+    if (argc != 2 || !isdigit((unsigned char) argv[1][0])) {
+        fprintf(stdout, "usage: damage [block number]\n");
+        return;
+    }
+    if (!mounted()) return;
+    int block_size = fs->block_size;
+    int blockNum = atoi(argv[1]);
+    if (blockNum >= fs->num_blocks) {
+        fprintf(stderr, "The disk has %d blocks\n", fs->num_blocks);
+        return;
+    }
+    AbandonLLFS(fs);
+    Disk* disk = openDisk(PATH_TO_VDISK, block_size, 0);
+    char* block = (char*) malloc(block_size);
+    memset(block, 0xFF, block_size);
+    writeBlock(disk, blockNum, block);
+    closeDisk(disk);
+    free(block);
+    fs = MountLLFSWith(PATH_TO_VDISK, backend);
+}
+
+void _readat(int argc, char** argv)
+{
+    /* Print size bytes of the file from offset, a bad offset or size is turned down */
+    if (argc != 5) {
+        fprintf(stdout, "usage: readat [file name] [offset] [size] [path]\n");
+        return;
+    }
+    if (!mounted()) return;
+    int size = atoi(argv[3]);
+    char* buffer = (char*) malloc(size > 0 ? size : 1);
+    int read = LLFS_ReadAt(fs, argv[1], buffer, size, atoi(argv[2]), argv[4]);
+    if (read == 0 && size != 0) fprintf(stderr, "%s\n", "Read file unsuccessful.");
+    else {
+        fwrite(buffer, 1, read, stdout);
+        printf("\n");
+    }
+    free(buffer);
+}
+
+void _writeat(int argc, char** argv)
+{
+    /* Write size bytes of 'x' at offset, or at the end of the file with end */
+    if (argc != 5) {
+        fprintf(stdout, "usage: writeat [file name] [offset | end] [size] [path]\n");
+        return;
+    }
+    if (!mounted()) return;
+    int size = atoi(argv[3]);
+    char* data = (char*) malloc(size > 0 ? size : 1);
+    memset(data, 'x', size > 0 ? size : 1);
+    int written;
+    if (strcmp(argv[2], "end") == 0) written = LLFS_Write(fs, argv[1], data, size, argv[4]) != 0;
+    else written = LLFS_WriteAt(fs, argv[1], data, size, atoi(argv[2]), argv[4]) == size;
+    if (!written) fprintf(stderr, "%s\n", "Write file unsuccessful.");
+    free(data);
 }
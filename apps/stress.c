@@ -0,0 +1,214 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "../io/File.h"
+#include "../disk/diskIO.h"
+
+/* Multithreaded stress test of the LLFS API on a scratch disk:
+     1. Read throughput with 1, 2, 4, ... threads reading the same set of files
+     2. Readers and writers together: every writer creates, fills, checks and
+        removes its own files while the readers go on, then the disk is remounted
+        and checked
+   usage: ./stress [max threads] [seconds per run] */
+
+#define STRESS_VDISK "stress_vdisk"
+#define NUM_FILES 64
+#define FILE_SIZE 16384
+#define DATA_DIR "/bench/data"
+
+typedef struct Worker Worker;
+struct Worker {
+    LLFS*         fs;
+    int           id;
+    unsigned int  seed;
+    long          ops;
+    long          errors;
+    char          exists[8]; // a writer's files
+    atomic_int*   stop;
+};
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned int next_random(unsigned int* seed)
+{
+    *seed ^= *seed << 13; // xorshift32
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+static void fill(char* buffer, int size, int key)
+{
+    /* The content of a file only depends on its key, so readers can check it */
+    for (int i = 0; i < size; i++) buffer[i] = (char) (key * 31 + i * 7);
+}
+
+static int check(char* buffer, int size, int key)
+{
+    for (int i = 0; i < size; i++) {
+        if (buffer[i] != (char) (key * 31 + i * 7)) return 0;
+    }
+    return 1;
+}
+
+static void* reader(void* arg)
+{
+    Worker* w = (Worker*) arg;
+    char* buffer = (char*) malloc(FILE_SIZE);
+    char name[16];
+    while (!atomic_load(w->stop)) {
+        int key = next_random(&w->seed) % NUM_FILES;
+        sprintf(name, "f%d", key);
+        if (LLFS_Read(w->fs, name, buffer, FILE_SIZE, DATA_DIR) == 0 || !check(buffer, FILE_SIZE, key)) w->errors++;
+        w->ops++;
+    }
+    free(buffer);
+    return NULL;
+}
+
+static void* writer(void* arg)
+{
+    /* Each writer has its own files in /stress, named after it */
+    Worker* w = (Worker*) arg;
+    char* data = (char*) malloc(4 * FILE_SIZE);
+    char* buffer = (char*) malloc(4 * FILE_SIZE);
+    char name[16];
+    while (!atomic_load(w->stop)) {
+        int n = next_random(&w->seed) % 8;
+        int key = 1000 * (w->id + 1) + n;
+        sprintf(name, "w%d_%d", w->id, n);
+        if (w->exists[n]) {
+            /* check it and remove it */
+            int size = LLFS_get_size(w->fs, name, "/stress");
+            if (LLFS_Read(w->fs, name, buffer, size, "/stress") == 0 || !check(buffer, size, key)) w->errors++;
+            if (LLFS_Rm(w->fs, name, "/stress") == 0) w->errors++;
+            w->exists[n] = 0;
+        } else {
+            int size = 1 + next_random(&w->seed) % (4 * FILE_SIZE);
+            fill(data, size, key);
+            if (LLFS_Touch(w->fs, name, "/stress") == 0 || LLFS_Write(w->fs, name, data, size, "/stress") == 0) w->errors++;
+            w->exists[n] = 1;
+        }
+        w->ops++;
+    }
+    free(data);
+    free(buffer);
+    return NULL;
+}
+
+static double run(LLFS* fs, int readers, int writers, double seconds, Worker* workers)
+{
+    /* Runs the threads for that long, returns how many reads per second they did */
+    pthread_t* threads = (pthread_t*) malloc((readers + writers) * sizeof(pthread_t));
+    atomic_int stop = 0;
+    for (int i = 0; i < readers + writers; i++) {
+        workers[i].fs = fs;
+        workers[i].id = i;
+        workers[i].seed = 2019 + i;
+        workers[i].ops = 0;
+        workers[i].errors = 0;
+        memset(workers[i].exists, 0, sizeof(workers[i].exists));
+        workers[i].stop = &stop;
+        pthread_create(&threads[i], NULL, (i < readers) ? reader : writer, &workers[i]);
+    }
+
+    struct timespec pause = { (time_t) seconds, (long) ((seconds - (time_t) seconds) * 1e9) };
+    double start = now();
+    nanosleep(&pause, NULL);
+    atomic_store(&stop, 1);
+    for (int i = 0; i < readers + writers; i++) pthread_join(threads[i], NULL);
+    double elapsed = now() - start;
+
+    long reads = 0;
+    for (int i = 0; i < readers; i++) reads += workers[i].ops;
+    free(threads);
+    return reads / elapsed;
+}
+
+static long errors(Worker* workers, int count)
+{
+    long total = 0;
+    for (int i = 0; i < count; i++) total += workers[i].errors;
+    return total;
+}
+
+int main(int argc, char** argv)
+{
+    int max_threads = (argc > 1) ? atoi(argv[1]) : 8;
+    double seconds = (argc > 2) ? atof(argv[2]) : 2;
+    if (max_threads < 1 || seconds <= 0) {
+        fprintf(stderr, "%s\n", "usage: ./stress [max threads] [seconds per run]");
+        return 1;
+    }
+
+    /* --- A scratch disk with the files to read --- */
+    if (!FormatLLFS(STRESS_VDISK, 4096, 16384, 4096)) return 1;
+    LLFS* fs = MountLLFS(STRESS_VDISK);
+    if (fs == NULL) return 1;
+    LLFS_Mkdir(fs, "bench", "/");
+    LLFS_Mkdir(fs, "data", "/bench");
+    LLFS_Mkdir(fs, "stress", "/");
+    char* data = (char*) malloc(FILE_SIZE);
+    char name[16];
+    for (int key = 0; key < NUM_FILES; key++) {
+        sprintf(name, "f%d", key);
+        fill(data, FILE_SIZE, key);
+        LLFS_Touch(fs, name, DATA_DIR);
+        LLFS_Write(fs, name, data, FILE_SIZE, DATA_DIR);
+    }
+    free(data);
+    int free_blocks = fs->free_blocks;
+    Worker* workers = (Worker*) malloc(2 * max_threads * sizeof(Worker));
+
+    /* --- 1. Readers only --- */
+    printf("%-8s %14s %10s %8s\n", "threads", "reads/s", "MB/s", "speedup");
+    double single = 0;
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        double rate = run(fs, threads, 0, seconds, workers);
+        if (threads == 1) single = rate;
+        printf("%-8d %14.0f %10.1f %7.2fx\n", threads, rate, rate * FILE_SIZE / 1e6, rate / single);
+        if (errors(workers, threads) > 0) printf("%ld bad reads\n", errors(workers, threads));
+    }
+
+    /* --- 2. Readers and writers, then everything is checked again after a remount --- */
+    int writers = (max_threads + 1) / 2;
+    double rate = run(fs, max_threads, writers, seconds, workers);
+    long writes = 0;
+    for (int i = max_threads; i < max_threads + writers; i++) writes += workers[i].ops;
+    long bad = errors(workers, max_threads + writers);
+    printf("%d readers and %d writers: %.0f reads/s, %ld writer ops, %ld errors\n", max_threads, writers, rate, writes, bad);
+
+    UnmountLLFS(fs);
+    fs = MountLLFS(STRESS_VDISK);
+    char* buffer = (char*) malloc(4 * FILE_SIZE);
+    for (int w = max_threads; w < max_threads + writers; w++) {
+        for (int n = 0; n < 8; n++) {
+            if (!workers[w].exists[n]) continue;
+            sprintf(name, "w%d_%d", w, n);
+            int size = LLFS_get_size(fs, name, "/stress");
+            if (LLFS_Read(fs, name, buffer, size, "/stress") == 0 || !check(buffer, size, 1000 * (w + 1) + n)) bad++;
+            if (LLFS_Rm(fs, name, "/stress") == 0) bad++;
+        }
+    }
+    free(buffer);
+    LLFS_Sync(fs);
+    if (fs->free_blocks != free_blocks) {
+        printf("%d free blocks instead of %d after removing the files\n", fs->free_blocks, free_blocks);
+        bad++;
+    }
+    printf("%s\n", bad ? "FAILED" : "OK");
+
+    UnmountLLFS(fs);
+    remove(STRESS_VDISK);
+    free(workers);
+    return bad ? 1 : 0;
+}
@@ -1,14 +1,750 @@
+#define _GNU_SOURCE // syscall() for io_uring
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 #include "diskIO.h"
+#include "../perf/stats.h"
+#include "../perf/trace.h"
 
-void readBlock(FILE* disk, int blockNum, char* buffer)
+static char* mappedBlock(Disk* disk, int blockNum)
 {
-    fseek(disk, blockNum * BLOCK_SIZE, SEEK_SET);
-    fread(buffer, BLOCK_SIZE, 1, disk);
+    if ((size_t) (blockNum + 1) * disk->block_size > disk->map_size) {
+        fprintf(stderr, "Block %d is past the end of the disk\n", blockNum);
+        abort();
+    }
+    return disk->map + (size_t) blockNum * disk->block_size;
 }
 
-void writeBlock(FILE* disk, int blockNum, char* data)
+static void rawRead(Disk* disk, int blockNum, char* buffer)
 {
-    fseek(disk, blockNum * BLOCK_SIZE, SEEK_SET);
-    fwrite(data, BLOCK_SIZE, 1, disk);
+    if (disk->map != NULL) {
+        memcpy(buffer, mappedBlock(disk, blockNum), disk->block_size);
+        return;
+    }
+    long long span = TRACE_BEGIN();
+    ssize_t n = pread(disk->fd, buffer, disk->block_size, (off_t) blockNum * disk->block_size);
+    TRACE_END("rawRead", span);
+    stats_transfer(0, (long long) blockNum * disk->block_size, disk->block_size, disk->block_size);
+    if (n < disk->block_size) memset(buffer + (n < 0 ? 0 : n), 0, disk->block_size - (n < 0 ? 0 : n));
+}
+
+static void rawWrite(Disk* disk, int blockNum, char* data)
+{
+    if (disk->failed) return;
+    if (disk->map != NULL) {
+        memcpy(mappedBlock(disk, blockNum), data, disk->block_size);
+        return;
+    }
+    stats_transfer(1, (long long) blockNum * disk->block_size, disk->block_size, disk->block_size);
+    long long span = TRACE_BEGIN();
+    if (pwrite(disk->fd, data, disk->block_size, (off_t) blockNum * disk->block_size) != disk->block_size)
+        fprintf(stderr, "Failed to write block %d\n", blockNum);
+    TRACE_END("rawWrite", span);
+}
+
+static void stop_engine(AsyncIO* aio);
+
+static void init_cache(Disk* disk, int cache_blocks)
+{
+    disk->cache_size = cache_blocks;
+    disk->first_size = cache_blocks;
+    if (cache_blocks <= 0) return;
+
+    disk->num_buckets = 1;
+    while (disk->num_buckets < 2 * cache_blocks) disk->num_buckets <<= 1;
+    disk->buckets = (int*) malloc(disk->num_buckets * sizeof(int));
+    for (int i = 0; i < disk->num_buckets; i++) disk->buckets[i] = -1;
+
+    disk->frames = (CacheFrame*) calloc(cache_blocks, sizeof(CacheFrame));
+    char* data = (char*) malloc((size_t) cache_blocks * disk->block_size);
+    for (int i = 0; i < cache_blocks; i++) {
+        disk->frames[i].blockNum = -1;
+        disk->frames[i].next = -1;
+        disk->frames[i].data = data + (size_t) i * disk->block_size;
+    }
+}
+
+Disk* openDisk(char* path, int block_size, int cache_blocks)
+{
+    int fd = open(path, O_RDWR);
+    if (fd < 0) return NULL;
+
+    Disk* disk = (Disk*) calloc(1, sizeof(Disk));
+    disk->fd = fd;
+    disk->block_size = block_size;
+    pthread_mutex_init(&disk->lock, NULL);
+    init_cache(disk, cache_blocks);
+    return disk;
+}
+
+Disk* mapDisk(char* path, int block_size, int cache_blocks)
+{
+    /* The cache stays in front of the mapping: a borrowed block is a private copy, so a
+       change that isn't committed yet can't be written back by the kernel. Misses and
+       write-backs are a memcpy from/to the mapping. */
+    int fd = open(path, O_RDWR);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    char* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        map = (char*) mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+
+    Disk* disk = (Disk*) calloc(1, sizeof(Disk));
+    disk->fd = fd;
+    disk->block_size = block_size;
+    pthread_mutex_init(&disk->lock, NULL);
+    disk->map = map;
+    disk->map_size = st.st_size;
+    init_cache(disk, cache_blocks);
+    return disk;
+}
+
+void closeDisk(Disk* disk)
+{
+    if (disk == NULL) return;
+    flushDisk(disk);
+    dropDisk(disk);
+}
+
+void dropDisk(Disk* disk)
+{
+    /* Close the disk without writing the dirty blocks back, what a crash leaves behind */
+    if (disk == NULL) return;
+    if (disk->map != NULL) munmap(disk->map, disk->map_size);
+    close(disk->fd);
+    if (disk->frames != NULL) {
+        free(disk->frames[0].data);
+        for (int f = disk->first_size; f < disk->cache_size; f *= 2) free(disk->frames[f].data); // added by grow_cache()
+    }
+    free(disk->frames);
+    free(disk->buckets);
+    stop_engine(disk->aio);
+    pthread_mutex_destroy(&disk->lock);
+    free(disk);
+}
+
+static int bucket_of(Disk* disk, int blockNum)
+{
+    return (blockNum * 2654435761u) & (disk->num_buckets - 1);
+}
+
+static int lookup_frame(Disk* disk, int blockNum)
+{
+    for (int f = disk->buckets[bucket_of(disk, blockNum)]; f != -1; f = disk->frames[f].next) {
+        if (disk->frames[f].blockNum == blockNum) return f;
+    }
+    return -1;
+}
+
+static void unlink_frame(Disk* disk, int f)
+{
+    int* link = &disk->buckets[bucket_of(disk, disk->frames[f].blockNum)];
+    while (*link != f) link = &disk->frames[*link].next;
+    *link = disk->frames[f].next;
+}
+
+static void grow_cache(Disk* disk)
+{
+    /* Twice as many frames, the new ones empty. The data of the old frames stays where it
+       is (borrowers keep pointers to it), the buckets are rebuilt for the new size. */
+    int old_size = disk->cache_size;
+    disk->cache_size = 2 * old_size;
+    disk->frames = (CacheFrame*) realloc(disk->frames, disk->cache_size * sizeof(CacheFrame));
+    char* data = (char*) malloc((size_t) old_size * disk->block_size);
+    for (int i = old_size; i < disk->cache_size; i++) {
+        memset(&disk->frames[i], 0, sizeof(CacheFrame));
+        disk->frames[i].blockNum = -1;
+        disk->frames[i].next = -1;
+        disk->frames[i].data = data + (size_t) (i - old_size) * disk->block_size;
+    }
+
+    disk->num_buckets *= 2;
+    disk->buckets = (int*) realloc(disk->buckets, disk->num_buckets * sizeof(int));
+    for (int i = 0; i < disk->num_buckets; i++) disk->buckets[i] = -1;
+    for (int f = 0; f < old_size; f++) {
+        if (disk->frames[f].blockNum == -1) continue;
+        int b = bucket_of(disk, disk->frames[f].blockNum);
+        disk->frames[f].next = disk->buckets[b];
+        disk->buckets[b] = f;
+    }
+    disk->hand = old_size;
+}
+
+static int evict_frame(Disk* disk)
+{
+    /* --- CLOCK: skip (and clear) recently used frames, never take a borrowed one (nor a dirty
+       one once the disk has failed, it's the only copy of its block). Two turns without a
+       candidate means every frame is taken, the cache grows rather than waiting (the
+       borrowers can be waiting for this thread's operation to finish). --- */
+    CacheFrame* frame;
+    for (int steps = 0; ; steps++) {
+        if (steps == 2 * disk->cache_size) {
+            grow_cache(disk);
+            steps = 0;
+        }
+        frame = &disk->frames[disk->hand];
+        if (frame->blockNum == -1 || (frame->ref == 0 && frame->pins == 0 && !(frame->dirty && disk->failed))) break;
+        frame->ref = 0;
+        disk->hand = (disk->hand + 1) % disk->cache_size;
+    }
+    int f = disk->hand;
+    disk->hand = (disk->hand + 1) % disk->cache_size;
+
+    if (frame->blockNum != -1) {
+        if (frame->dirty) rawWrite(disk, frame->blockNum, frame->data);
+        unlink_frame(disk, f);
+    }
+    frame->blockNum = -1;
+    frame->dirty = 0;
+    return f;
+}
+
+static int insert_frame(Disk* disk, int blockNum)
+{
+    int f = evict_frame(disk);
+    int b = bucket_of(disk, blockNum);
+    disk->frames[f].blockNum = blockNum;
+    disk->frames[f].next = disk->buckets[b];
+    disk->buckets[b] = f;
+    return f;
+}
+
+static int cached_frame(Disk* disk, int blockNum, int fill)
+{
+    /* The frame holding blockNum, read from the vdisk (if fill) on a miss */
+    int f = lookup_frame(disk, blockNum);
+    if (f != -1) {
+        disk->hits++;
+        stats_add(STAT_CACHE_HITS, 1);
+    } else {
+        disk->misses++;
+        f = insert_frame(disk, blockNum);
+        if (fill) rawRead(disk, blockNum, disk->frames[f].data);
+    }
+    disk->frames[f].ref = 1;
+    return f;
+}
+
+void readBlock(Disk* disk, int blockNum, char* buffer)
+{
+    if (disk->first_size <= 0) rawRead(disk, blockNum, buffer);
+    else {
+        pthread_mutex_lock(&disk->lock);
+        memcpy(buffer, disk->frames[cached_frame(disk, blockNum, 1)].data, disk->block_size);
+        pthread_mutex_unlock(&disk->lock);
+    }
+}
+
+void writeBlock(Disk* disk, int blockNum, char* data)
+{
+    if (disk->first_size <= 0) rawWrite(disk, blockNum, data);
+    else {
+        pthread_mutex_lock(&disk->lock);
+        int f = cached_frame(disk, blockNum, 0); // whole block is overwritten, no need to read it
+        disk->frames[f].dirty = 1;
+        memcpy(disk->frames[f].data, data, disk->block_size);
+        pthread_mutex_unlock(&disk->lock);
+    }
+}
+
+char* getBlock(Disk* disk, int blockNum)
+{
+    /* Borrow the block in place (pinned in the cache, or in a mapping without a cache) until putBlock() */
+    if (disk->first_size <= 0 && disk->map != NULL) return mappedBlock(disk, blockNum);
+    if (disk->first_size <= 0) {
+        char* block = (char*) malloc(disk->block_size);
+        rawRead(disk, blockNum, block);
+        return block;
+    }
+    pthread_mutex_lock(&disk->lock);
+    int f = cached_frame(disk, blockNum, 1);
+    disk->frames[f].pins++;
+    char* block = disk->frames[f].data; // frames can be reallocated by grow_cache() once unlocked
+    pthread_mutex_unlock(&disk->lock);
+    return block;
+}
+
+void putBlock(Disk* disk, int blockNum, char* block, int dirty)
+{
+    if (disk->first_size <= 0 && disk->map != NULL) return; // the mapping already has the changes
+    if (disk->first_size <= 0) {
+        if (dirty) rawWrite(disk, blockNum, block);
+        free(block);
+        return;
+    }
+    pthread_mutex_lock(&disk->lock);
+    int f = lookup_frame(disk, blockNum);
+    if (dirty) disk->frames[f].dirty = 1;
+    disk->frames[f].pins--;
+    pthread_mutex_unlock(&disk->lock);
+}
+
+/* --- Asynchronous batches: requests are queued, submitted IO_QUEUE_DEPTH at a time (to
+   io_uring, or to a pool of worker threads where the kernel doesn't allow it) and waited
+   for together by finishBatch() --- */
+
+typedef struct IORequest IORequest;
+struct IORequest {
+    IOBatch*     batch;
+    int          write;
+    char*        buffer;
+    size_t       length;
+    off_t        offset;
+    struct iovec iov;     // what io_uring transfers
+    IORequest*   next;    // in the worker queue
+};
+
+typedef struct IOChunk IOChunk;
+struct IOChunk {
+    IOChunk*  next;
+    IORequest requests[IO_QUEUE_DEPTH];
+};
+
+struct IOBatch {
+    Disk*    disk;
+    IOChunk* chunk;     // being filled, the submitted ones follow it
+    int      queued;    // requests in chunk, not submitted yet
+    int      submitted; // chunks handed to the engine
+    int      pending;   // submitted requests that haven't completed, under the engine lock
+    int      failed;
+};
+
+struct AsyncIO {
+    pthread_mutex_t lock;
+    pthread_cond_t  done;       // some request completed
+    int             ring_fd;    // -1 when the worker threads do the transfers
+
+    /* --- io_uring --- */
+    unsigned*       sq_tail;
+    unsigned*       sq_mask;
+    unsigned*       sq_array;
+    unsigned*       cq_head;
+    unsigned*       cq_tail;
+    unsigned*       cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void*           sq_ring;
+    size_t          sq_ring_size;
+    void*           cq_ring;
+    size_t          cq_ring_size;
+    size_t          sqes_size;
+    unsigned        entries;
+    unsigned        in_flight;  // submitted, not reaped
+    unsigned        unsubmitted; // in the SQ ring, io_uring_enter() not called yet
+    int             reaping;    // a thread waits in io_uring_enter(), the others on done
+
+    /* --- Worker threads --- */
+    pthread_t       workers[IO_WORKERS];
+    pthread_cond_t  work;
+    IORequest*      queue_head;
+    IORequest*      queue_tail;
+    int             stop;
+};
+
+static int transfer(int fd, IORequest* r)
+{
+    /* The whole request with pread/pwrite, returns the bytes transferred or -errno */
+    size_t done = 0;
+    while (done < r->length) {
+        ssize_t n = r->write ? pwrite(fd, r->buffer + done, r->length - done, r->offset + done)
+                             : pread(fd, r->buffer + done, r->length - done, r->offset + done);
+        if (n < 0) return -errno;
+        if (n == 0) break; // past the end of the vdisk
+        done += n;
+    }
+    return (int) done;
+}
+
+static void complete(IORequest* r, int result)
+{
+    /* A read past the end of the vdisk gives zeros, like rawRead() */
+    if (!r->write && result >= 0 && (size_t) result < r->length) {
+        memset(r->buffer + result, 0, r->length - result);
+        result = r->length;
+    }
+    if (result < 0 || (size_t) result < r->length) {
+        fprintf(stderr, "Failed to %s %zu bytes at offset %lld\n", r->write ? "write" : "read", r->length, (long long) r->offset);
+        r->batch->failed = 1;
+    }
+    r->batch->pending--;
+}
+
+static void* io_worker(void* arg)
+{
+    AsyncIO* aio = (AsyncIO*) arg;
+    pthread_mutex_lock(&aio->lock);
+    while (1) {
+        while (aio->queue_head == NULL && !aio->stop) pthread_cond_wait(&aio->work, &aio->lock);
+        if (aio->queue_head == NULL) break;
+        IORequest* r = aio->queue_head;
+        aio->queue_head = r->next;
+        pthread_mutex_unlock(&aio->lock);
+
+        int result = transfer(r->batch->disk->fd, r);
+
+        pthread_mutex_lock(&aio->lock);
+        complete(r, result);
+        pthread_cond_broadcast(&aio->done);
+    }
+    pthread_mutex_unlock(&aio->lock);
+    return NULL;
+}
+
+static int ring_setup(AsyncIO* aio)
+{
+    /* io_uring through the raw system calls, 0 if the kernel doesn't have it or won't let us use it */
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = (int) syscall(__NR_io_uring_setup, IO_QUEUE_DEPTH, &p);
+    if (fd < 0) return 0;
+
+    aio->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    aio->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    aio->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    aio->sq_ring = mmap(NULL, aio->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    aio->cq_ring = mmap(NULL, aio->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    aio->sqes = (struct io_uring_sqe*) mmap(NULL, aio->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (aio->sq_ring == MAP_FAILED || aio->cq_ring == MAP_FAILED || aio->sqes == MAP_FAILED) {
+        if (aio->sq_ring != MAP_FAILED) munmap(aio->sq_ring, aio->sq_ring_size);
+        if (aio->cq_ring != MAP_FAILED) munmap(aio->cq_ring, aio->cq_ring_size);
+        if (aio->sqes != MAP_FAILED) munmap(aio->sqes, aio->sqes_size);
+        close(fd);
+        return 0;
+    }
+
+    char* sq = (char*) aio->sq_ring;
+    char* cq = (char*) aio->cq_ring;
+    aio->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+    aio->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+    aio->sq_array = (unsigned*) (sq + p.sq_off.array);
+    aio->cq_head = (unsigned*) (cq + p.cq_off.head);
+    aio->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+    aio->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+    aio->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+    aio->entries = p.sq_entries; // the CQ ring is bigger, so it can't overflow with this many in flight
+    aio->ring_fd = fd;
+    return 1;
+}
+
+static AsyncIO* start_engine()
+{
+    AsyncIO* aio = (AsyncIO*) calloc(1, sizeof(AsyncIO));
+    pthread_mutex_init(&aio->lock, NULL);
+    pthread_cond_init(&aio->done, NULL);
+    pthread_cond_init(&aio->work, NULL);
+    aio->ring_fd = -1;
+    if (IO_URING && ring_setup(aio)) return aio;
+
+    for (int i = 0; i < IO_WORKERS; i++) pthread_create(&aio->workers[i], NULL, io_worker, aio);
+    return aio;
+}
+
+static void stop_engine(AsyncIO* aio)
+{
+    if (aio == NULL) return;
+    if (aio->ring_fd >= 0) {
+        munmap(aio->sq_ring, aio->sq_ring_size);
+        munmap(aio->cq_ring, aio->cq_ring_size);
+        munmap(aio->sqes, aio->sqes_size);
+        close(aio->ring_fd);
+    } else {
+        pthread_mutex_lock(&aio->lock);
+        aio->stop = 1;
+        pthread_cond_broadcast(&aio->work);
+        pthread_mutex_unlock(&aio->lock);
+        for (int i = 0; i < IO_WORKERS; i++) pthread_join(aio->workers[i], NULL);
+    }
+    pthread_cond_destroy(&aio->work);
+    pthread_cond_destroy(&aio->done);
+    pthread_mutex_destroy(&aio->lock);
+    free(aio);
+}
+
+static void ring_enter(AsyncIO* aio, int wait)
+{
+    /* Submit what's in the SQ ring and, if wait, block (without the lock) until
+       something completes, then reap the completions. The lock is held. */
+    unsigned to_submit = aio->unsubmitted;
+    aio->unsubmitted = 0;
+    if (wait) aio->reaping = 1;
+    pthread_mutex_unlock(&aio->lock);
+    while (syscall(__NR_io_uring_enter, aio->ring_fd, to_submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0
+           && errno == EINTR);
+    pthread_mutex_lock(&aio->lock);
+    if (!wait && aio->reaping) return; // the completions are left to the thread waiting for them
+
+    unsigned head = *aio->cq_head;
+    unsigned tail = __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe* cqe = &aio->cqes[head & *aio->cq_mask];
+        complete((IORequest*) (uintptr_t) cqe->user_data, cqe->res);
+        aio->in_flight--;
+    }
+    __atomic_store_n(aio->cq_head, head, __ATOMIC_RELEASE);
+    if (wait) aio->reaping = 0;
+    pthread_cond_broadcast(&aio->done);
+}
+
+static void wait_engine(AsyncIO* aio)
+{
+    /* Until some request completes. The lock is held. */
+    if (aio->ring_fd >= 0 && !aio->reaping) ring_enter(aio, 1);
+    else pthread_cond_wait(&aio->done, &aio->lock);
+}
+
+static void submit_chunk(IOBatch* batch)
+{
+    /* Hand the queued requests of the batch to the engine */
+    Disk* disk = batch->disk;
+    int count = batch->queued;
+    if (count == 0) return;
+    pthread_mutex_lock(&disk->lock);
+    if (disk->aio == NULL) disk->aio = start_engine(); // on first use, most disks never need it
+    pthread_mutex_unlock(&disk->lock);
+
+    AsyncIO* aio = disk->aio;
+    pthread_mutex_lock(&aio->lock);
+    batch->pending += count;
+    for (int i = 0; i < count; i++) {
+        IORequest* r = &batch->chunk->requests[i];
+        if (aio->ring_fd < 0) {
+            r->next = NULL;
+            if (aio->queue_head == NULL) aio->queue_head = r;
+            else aio->queue_tail->next = r;
+            aio->queue_tail = r;
+            continue;
+        }
+
+        while (aio->in_flight == aio->entries) {
+            if (aio->unsubmitted > 0) ring_enter(aio, 0);
+            else wait_engine(aio);
+        }
+        unsigned tail = *aio->sq_tail;
+        unsigned index = tail & *aio->sq_mask;
+        struct io_uring_sqe* sqe = &aio->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = r->write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd = batch->disk->fd;
+        sqe->off = r->offset;
+        sqe->addr = (uintptr_t) &r->iov;
+        sqe->len = 1;
+        sqe->user_data = (uintptr_t) r;
+        aio->sq_array[index] = index;
+        __atomic_store_n(aio->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        aio->in_flight++;
+        aio->unsubmitted++;
+    }
+    if (aio->ring_fd < 0) pthread_cond_broadcast(&aio->work);
+    else if (aio->unsubmitted > 0) ring_enter(aio, 0);
+    pthread_mutex_unlock(&aio->lock);
+
+    batch->submitted++;
+    batch->queued = 0;
+    IOChunk* chunk = (IOChunk*) malloc(sizeof(IOChunk));
+    chunk->next = batch->chunk;
+    batch->chunk = chunk;
+}
+
+static void queue_request(IOBatch* batch, int write, char* buffer, size_t length, off_t offset)
+{
+    if (batch->queued == IO_QUEUE_DEPTH) submit_chunk(batch); // the rest keeps queuing meanwhile
+    IORequest* r = &batch->chunk->requests[batch->queued++];
+    r->batch = batch;
+    r->write = write;
+    r->buffer = buffer;
+    r->length = length;
+    r->offset = offset;
+    r->iov.iov_base = buffer;
+    r->iov.iov_len = length;
+    stats_transfer(write, offset, length, batch->disk->block_size); // counted for the thread that asked for it
+}
+
+IOBatch* startBatch(Disk* disk)
+{
+    IOBatch* batch = (IOBatch*) calloc(1, sizeof(IOBatch));
+    batch->disk = disk;
+    batch->chunk = (IOChunk*) malloc(sizeof(IOChunk));
+    batch->chunk->next = NULL;
+    return batch;
+}
+
+void batchRead(IOBatch* batch, int blockNum, char* buffer, int length)
+{
+    /* Reads length bytes starting at blockNum into buffer by the time finishBatch() returns.
+       Blocks that are in the cache (maybe dirty) are copied from there right away, each run
+       of uncached blocks is one request. Nothing is added to the cache. */
+    Disk* disk = batch->disk;
+    if (disk->map != NULL) mappedBlock(disk, blockNum + (length - 1) / disk->block_size);
+
+    int count = (length + disk->block_size - 1) / disk->block_size;
+    for (int i = 0, run; i < count; i += run) {
+        size_t offset = (size_t) i * disk->block_size;
+        if (disk->first_size > 0) {
+            pthread_mutex_lock(&disk->lock);
+            int f = lookup_frame(disk, blockNum + i);
+            if (f != -1) {
+                disk->hits++;
+                stats_add(STAT_CACHE_HITS, 1);
+                disk->frames[f].ref = 1;
+                memcpy(buffer + offset, disk->frames[f].data, length - offset < disk->block_size ? length - offset : disk->block_size);
+                pthread_mutex_unlock(&disk->lock);
+                run = 1;
+                continue;
+            }
+            for (run = 1; i + run < count; run++) {
+                if (lookup_frame(disk, blockNum + i + run) != -1) break;
+            }
+            pthread_mutex_unlock(&disk->lock);
+        } else run = count - i;
+
+        size_t bytes = (size_t) run * disk->block_size;
+        if (bytes > length - offset) bytes = length - offset;
+        if (disk->map != NULL) memcpy(buffer + offset, mappedBlock(disk, blockNum + i), bytes);
+        else queue_request(batch, 0, buffer + offset, bytes, (off_t) (blockNum + i) * disk->block_size);
+    }
+}
+
+static void keep_blocks(Disk* disk, int blockNum, int count, char* data)
+{
+    /* After failDisk(): what would have been written stays in the cache as dirty frames,
+       which aren't evicted anymore, so reads still see it */
+    if (disk->first_size <= 0) return;
+    pthread_mutex_lock(&disk->lock);
+    for (int i = 0; i < count; i++) {
+        int f = cached_frame(disk, blockNum + i, 0);
+        if (disk->frames[f].data != data + (size_t) i * disk->block_size) {
+            memcpy(disk->frames[f].data, data + (size_t) i * disk->block_size, disk->block_size);
+        }
+        disk->frames[f].dirty = 1;
+    }
+    pthread_mutex_unlock(&disk->lock);
+}
+
+void batchWrite(IOBatch* batch, int blockNum, int count, char* data)
+{
+    /* Writes count blocks from data (which has to stay as it is until finishBatch()) as
+       one request, cached copies are refreshed now and become clean */
+    Disk* disk = batch->disk;
+    size_t length = (size_t) count * disk->block_size;
+    if (disk->failed) {
+        keep_blocks(disk, blockNum, count, data);
+        return;
+    }
+    if (disk->map != NULL) {
+        mappedBlock(disk, blockNum + count - 1);
+        if (mappedBlock(disk, blockNum) != data) memcpy(mappedBlock(disk, blockNum), data, length); // a borrowed block of an uncached mapping
+    } else queue_request(batch, 1, data, length, (off_t) blockNum * disk->block_size);
+
+    if (disk->first_size <= 0) return;
+    pthread_mutex_lock(&disk->lock);
+    for (int i = 0; i < count; i++) {
+        int f = lookup_frame(disk, blockNum + i);
+        if (f == -1) continue;
+        if (disk->frames[f].data != data + (size_t) i * disk->block_size) { // not the cached copy itself
+            memcpy(disk->frames[f].data, data + (size_t) i * disk->block_size, disk->block_size);
+        }
+        disk->frames[f].dirty = 0;
+    }
+    pthread_mutex_unlock(&disk->lock);
+}
+
+int finishBatch(IOBatch* batch)
+{
+    /* Submit what's left and wait for every request of the batch, returns 0 if one failed.
+       A batch of one request is done right here, there's nothing to overlap it with. */
+    long long span = TRACE_BEGIN();
+    Disk* disk = batch->disk;
+    if (batch->submitted == 0 && batch->queued == 1) {
+        IORequest* r = &batch->chunk->requests[0];
+        r->batch = batch;
+        batch->pending = 1;
+        complete(r, transfer(disk->fd, r));
+    } else submit_chunk(batch);
+
+    if (batch->submitted > 0) {
+        AsyncIO* aio = disk->aio;
+        pthread_mutex_lock(&aio->lock);
+        while (batch->pending > 0) wait_engine(aio);
+        pthread_mutex_unlock(&aio->lock);
+    }
+
+    int ok = !batch->failed;
+    while (batch->chunk != NULL) {
+        IOChunk* next = batch->chunk->next;
+        free(batch->chunk);
+        batch->chunk = next;
+    }
+    free(batch);
+    TRACE_END("finishBatch", span);
+    return ok;
+}
+
+void readBlocks(Disk* disk, int blockNum, char* buffer, int length)
+{
+    IOBatch* batch = startBatch(disk);
+    batchRead(batch, blockNum, buffer, length);
+    finishBatch(batch);
+}
+
+void writeBlocks(Disk* disk, int blockNum, int count, char* data)
+{
+    IOBatch* batch = startBatch(disk);
+    batchWrite(batch, blockNum, count, data);
+    if (!finishBatch(batch)) fprintf(stderr, "Failed to write blocks %d to %d\n", blockNum, blockNum + count - 1);
+}
+
+void flushDisk(Disk* disk)
+{
+    long long span = TRACE_BEGIN();
+    pthread_mutex_lock(&disk->lock);
+    for (int f = 0; f < disk->cache_size; f++) {
+        CacheFrame* frame = &disk->frames[f];
+        if (frame->blockNum != -1 && frame->dirty && frame->pins == 0 && !disk->failed) { // a borrowed one can be halfway through a change
+            rawWrite(disk, frame->blockNum, frame->data);
+            frame->dirty = 0;
+        }
+    }
+    pthread_mutex_unlock(&disk->lock);
+    if (disk->map != NULL) msync(disk->map, disk->map_size, MS_SYNC);
+    TRACE_END("flushDisk", span);
+}
+
+void failDisk(Disk* disk)
+{
+    /* The power goes out: nothing written from now on reaches the vdisk (for crash tests).
+       The cache keeps the lost blocks, so the file system can go on until it's abandoned. */
+    pthread_mutex_lock(&disk->lock);
+    disk->failed = 1;
+    pthread_mutex_unlock(&disk->lock);
+}
+
+void syncDisk(Disk* disk)
+{
+    /* Wait until what was written so far (not the dirty cached blocks) is on stable storage */
+    long long span = TRACE_BEGIN();
+    if (disk->map != NULL) msync(disk->map, disk->map_size, MS_SYNC);
+    else fdatasync(disk->fd);
+    TRACE_END("syncDisk", span);
+}
+
+void getCacheStats(Disk* disk, long* hits, long* misses)
+{
+    pthread_mutex_lock(&disk->lock);
+    *hits = disk->hits;
+    *misses = disk->misses;
+    pthread_mutex_unlock(&disk->lock);
 }
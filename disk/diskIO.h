@@ -1,10 +1,85 @@
 #ifndef __diskIO_h__
 #define __diskIO_h__
 
-#define BLOCK_SIZE 512
-#define NUM_BLOCKS 4096
+#include <pthread.h>
 
-void readBlock(FILE* disk, int blockNum, char* buffer);
-void writeBlock(FILE* disk, int blockNum, char* data);
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 65536
+#define DEFAULT_BLOCK_SIZE 512
+#define DEFAULT_NUM_BLOCKS 4096
+#define DISK_CACHED 0 // pread/pwrite behind the block cache
+#define DISK_MMAP   1 // the whole vdisk mapped in memory
+#ifndef DEFAULT_BACKEND
+#define DEFAULT_BACKEND DISK_CACHED // can be overridden at build time
+#endif
+#ifndef DEFAULT_CACHE_BLOCKS
+#define DEFAULT_CACHE_BLOCKS 256 // can be overridden at build time
+#endif
+#ifndef IO_URING
+#define IO_URING 1        // 0 to always use the worker threads for batches
+#endif
+#ifndef IO_QUEUE_DEPTH
+#define IO_QUEUE_DEPTH 64 // requests a batch submits at once
+#endif
+#ifndef IO_WORKERS
+#define IO_WORKERS 4      // threads doing the transfers without io_uring
+#endif
+
+/* One slot of the block cache */
+typedef struct CacheFrame CacheFrame;
+struct CacheFrame {
+    int   blockNum; // -1 when the frame is empty
+    char  dirty;    // 1 if it has to be written back before being reused
+    char  ref;      // CLOCK reference bit
+    int   pins;     // borrowed by getBlock(), can't be evicted
+    int   next;     // next frame in the same hash bucket, -1 ends the chain
+    char* data;
+};
+
+/* The engine behind asynchronous batches (io_uring or worker threads), and a batch of
+   block transfers that are submitted together and waited for with finishBatch() */
+typedef struct AsyncIO AsyncIO;
+typedef struct IOBatch IOBatch;
+
+/* The open vdisk, read and written with pread/pwrite or mapped in memory, plus a
+   write-back block cache (CLOCK eviction, doubled when every frame is borrowed).
+   The cache can be used from several threads, lock protects the frames and the counters. */
+typedef struct Disk Disk;
+struct Disk {
+    int         fd;
+    int         block_size;
+    pthread_mutex_t lock;
+    char*       map;         // NULL unless opened with mapDisk()
+    size_t      map_size;
+    int         cache_size;  // number of frames, 0 disables the cache
+    int         first_size;  // frames of the first data chunk, the cache only grows by doubling
+    CacheFrame* frames;
+    int*        buckets;     // blockNum -> first frame of its chain
+    int         num_buckets; // power of 2
+    int         hand;        // CLOCK hand
+    long        hits;
+    long        misses;
+    AsyncIO*    aio;         // started by the first batch that needs it
+    int         failed;      // set by failDisk(), writes are lost from then on
+};
+
+Disk* openDisk(char* path, int block_size, int cache_blocks);
+Disk* mapDisk(char* path, int block_size, int cache_blocks);
+void  closeDisk(Disk* disk);
+void  dropDisk(Disk* disk);
+void  failDisk(Disk* disk);
+void  readBlock(Disk* disk, int blockNum, char* buffer);
+void  writeBlock(Disk* disk, int blockNum, char* data);
+char* getBlock(Disk* disk, int blockNum);
+void  putBlock(Disk* disk, int blockNum, char* block, int dirty);
+void  readBlocks(Disk* disk, int blockNum, char* buffer, int length);
+void  writeBlocks(Disk* disk, int blockNum, int count, char* data);
+IOBatch* startBatch(Disk* disk);
+void  batchRead(IOBatch* batch, int blockNum, char* buffer, int length);
+void  batchWrite(IOBatch* batch, int blockNum, int count, char* data);
+int   finishBatch(IOBatch* batch);
+void  flushDisk(Disk* disk);
+void  syncDisk(Disk* disk);
+void  getCacheStats(Disk* disk, long* hits, long* misses);
 
 #endif
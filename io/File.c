@@ -1,557 +1,2839 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include "File.h"
 #include "../disk/diskIO.h"
+#include "../perf/stats.h"
+#include "../perf/trace.h"
+
+/* --- Superblock (block 0) layout --- */
+#define LLFS_MAGIC 2019
+#define LLFS_VERSION 4
+#define SB_MAGIC 0
+#define SB_NUM_BLOCKS 4
+#define SB_NUM_INODES 8
+#define SB_BLOCK_SIZE 24
+#define SB_BITMAP_BLOCKS 28
+#define SB_INODE_START 32
+#define SB_DATA_START 36
+#define SB_VERSION 40
+#define SB_INODE_SIZE 44
+#define SB_JOURNAL_START 48
+#define SB_JOURNAL_BLOCKS 52
+#define SB_DIRTY_REGIONS 56 // 8 bytes, see mark_dirty_regions()
+
+/* --- Journal blocks: a header (block 0 of the journal), then descriptor, images, commit --- */
+#define JOURNAL_MAGIC 0x4A4C4C46
+#define J_HEADER 0
+#define J_DESCRIPTOR 1
+#define J_COMMIT 2
+
+/* --- Locking ---
+   Locks are always taken in this order, so two threads can't end up waiting for each other:
+     1. the journal lock, shared by every operation that changes metadata (from begin_operation()
+        to end_operation()) and exclusive for a commit, which holds no other lock
+     2. inode locks, down the tree: a directory before the files in it (walk_path() locks the
+        next directory before letting go of the current one)
+     3. the allocator lock: bitmap, inode map, free count, pending frees
+     4. the transaction lock (txn and the dirty flags), the directory index lock or a dentry
+        cache stripe, then the block cache lock in diskIO.c
+   Reading a file takes shared inode locks and the short locks of 4, so readers run in parallel. */
+#define DCACHE_LOCKS 64 // stripes of the dentry cache
+#define DIRTY_REGIONS 64 // parts of the inode table the dirty-region marker tells apart
+#define FSCK_REPORTS 20  // problems printed by a check, the others are only counted
+
+struct LLFSLocks {
+    pthread_rwlock_t  journal;
+    pthread_mutex_t   alloc;
+    pthread_mutex_t   txn;
+    pthread_mutex_t   index;
+    pthread_mutex_t   dcache[DCACHE_LOCKS];
+    pthread_rwlock_t* inodes; // by inode_id - ROOT_INODE
+};
+
+static unsigned long long load_bitmap_word(char* p)
+{
+    /* Bit 0 of the bitmap is the MSB of byte 0, so read the 8 bytes big-endian */
+    unsigned long long word = 0;
+    for (int i = 0; i < 8; i++) word = (word << 8) | (unsigned char) p[i];
+    return word;
+}
+
+static int next_bit(char* bitmap, int from, int end, int want_free)
+{
+    /* First bit in [from, end) that is free (1) or occupied (0), end if there's none */
+    while (from < end) {
+        int w = from / 64;
+        unsigned long long word = load_bitmap_word(bitmap + 8 * (size_t) w);
+        if (!want_free) word = ~word;
+        word &= ~0ULL >> (from % 64); // ignore the bits before from
+        if (word != 0) {
+            int bit = w * 64 + __builtin_clzll(word);
+            return bit < end ? bit : end;
+        }
+        from = (w + 1) * 64;
+    }
+    return end;
+}
+
+static int is_free(char* bitmap, int bit)
+{
+    return (bitmap[bit / 8] & (0x80 >> (bit % 8))) != 0;
+}
+
+static void dirty_bitmap(LLFS* fs, int blockNum)
+{
+    int i = blockNum / (8 * fs->block_size);
+    pthread_mutex_lock(&fs->locks->txn);
+    if (!fs->bitmap_dirty[i]) fs->journal_resident++;
+    fs->bitmap_dirty[i] = 1;
+    pthread_mutex_unlock(&fs->locks->txn);
+}
+
+static void dirty_inode(LLFS* fs, int inode_id)
+{
+    int i = (inode_id - ROOT_INODE) / fs->inodes_per_block;
+    pthread_mutex_lock(&fs->locks->txn);
+    if (!fs->inode_dirty[i]) fs->journal_resident++;
+    fs->inode_dirty[i] = 1;
+    pthread_mutex_unlock(&fs->locks->txn);
+}
+
+static void mark_used(LLFS* fs, int blockNum)
+{
+    fs->bitmap[blockNum / 8] &= ~(0x80 >> (blockNum % 8));
+    dirty_bitmap(fs, blockNum);
+    if (blockNum >= fs->data_start) fs->free_blocks--;
+}
+
+static void mark_free(LLFS* fs, int blockNum)
+{
+    fs->bitmap[blockNum / 8] |= 0x80 >> (blockNum % 8);
+    dirty_bitmap(fs, blockNum);
+    if (blockNum >= fs->data_start) fs->free_blocks++;
+}
+
+static int count_free_blocks(LLFS* fs)
+{
+    int free_blocks = 0;
+    for (int p = next_bit(fs->bitmap, fs->data_start, fs->num_blocks, 1); p < fs->num_blocks; ) {
+        int end = next_bit(fs->bitmap, p, fs->num_blocks, 0);
+        free_blocks += end - p;
+        p = next_bit(fs->bitmap, end, fs->num_blocks, 1);
+    }
+    return free_blocks;
+}
+
+static int enough_free_blocks(LLFS* fs, int n)
+{
+    return fs->free_blocks - fs->reserved_blocks >= n;
+}
+
+static char* inode_ptr(LLFS* fs, int inode_id)
+{
+    /* The inode table blocks are contiguous in memory, so the inodes are too */
+    return fs->inodes + (size_t) (inode_id - ROOT_INODE) * INODE_SIZE;
+}
+
+static int take_block(LLFS* fs, int data_type)
+{
+    int lower_bound, upper_bound;
+
+    // 0 for metadata, 1 for filedata
+    if (data_type == 0) {
+        lower_bound = fs->inode_start;
+        upper_bound = fs->data_start;
+    } else {
+        lower_bound = fs->data_start;
+        upper_bound = fs->num_blocks;
+    }
+
+    /* --- Next-fit: scan 64 bits at a time from where the last search stopped, then wrap around --- */
+    int cursor = fs->next_fit[data_type];
+    int blockNum = next_bit(fs->bitmap, cursor, upper_bound, 1);
+    if (blockNum == upper_bound) {
+        blockNum = next_bit(fs->bitmap, lower_bound, cursor, 1);
+        if (blockNum == cursor) return 0; // means no available blocks
+    }
+    mark_used(fs, blockNum);
+    fs->next_fit[data_type] = blockNum;
+    return blockNum;
+}
+
+int find_available_block(LLFS* fs, int data_type)
+{
+    long long span = TRACE_BEGIN();
+    stats_add(STAT_ALLOCS, 1);
+    pthread_mutex_lock(&fs->locks->alloc);
+    int blockNum = (data_type == 1 && !enough_free_blocks(fs, 1)) ? 0 : take_block(fs, data_type);
+    pthread_mutex_unlock(&fs->locks->alloc);
+    TRACE_END("find_available_block", span);
+    return blockNum;
+}
+
+typedef struct Run Run;
+struct Run {
+    int start;
+    int length;
+};
+
+static int longest_first(const void* a, const void* b)
+{
+    return ((Run*) b)->length - ((Run*) a)->length;
+}
+
+static void take_run(LLFS* fs, int start, int length, int* blocks)
+{
+    for (int blockNum = start; blockNum < start + length; blockNum++) {
+        mark_used(fs, blockNum);
+        *blocks++ = blockNum;
+    }
+    fs->next_fit[1] = start + length;
+}
+
+static int first_fit(LLFS* fs, int from, int to, int n)
+{
+    /* Start of the first free run of at least n data blocks that starts in [from, to), -1 if there's none */
+    for (int p = next_bit(fs->bitmap, from, to, 1); p < to; ) {
+        int end = next_bit(fs->bitmap, p, fs->num_blocks, 0);
+        if (end - p >= n) return p;
+        p = next_bit(fs->bitmap, end, to, 1);
+    }
+    return -1;
+}
+
+static void take_blocks(LLFS* fs, int n, int goal, int* blocks)
+{
+    int lower_bound = fs->data_start;
+    int upper_bound = fs->num_blocks;
+    if (goal >= lower_bound && goal <= upper_bound - n && next_bit(fs->bitmap, goal, goal + n, 0) == goal + n) {
+        take_run(fs, goal, n, blocks);
+        return;
+    }
+
+    /* --- The first run that is long enough from the cursor on, then wrapping around --- */
+    int cursor = fs->next_fit[1];
+    int start = first_fit(fs, cursor, upper_bound, n);
+    if (start == -1) start = first_fit(fs, lower_bound, cursor, n);
+    if (start != -1) {
+        take_run(fs, start, n, blocks);
+        return;
+    }
+
+    /* --- Split over the longest runs --- */
+    int num_runs = 0, max_runs = 64;
+    Run* runs = (Run*) malloc(max_runs * sizeof(Run));
+    for (int p = next_bit(fs->bitmap, lower_bound, upper_bound, 1); p < upper_bound; ) {
+        int end = next_bit(fs->bitmap, p, upper_bound, 0);
+        if (num_runs == max_runs) {
+            max_runs *= 2;
+            runs = (Run*) realloc(runs, max_runs * sizeof(Run));
+        }
+        runs[num_runs].start = p;
+        runs[num_runs].length = end - p;
+        num_runs++;
+        p = next_bit(fs->bitmap, end, upper_bound, 1);
+    }
+    qsort(runs, num_runs, sizeof(Run), longest_first);
+    for (int i = 0; n > 0; i++) {
+        int length = runs[i].length < n ? runs[i].length : n;
+        take_run(fs, runs[i].start, length, blocks);
+        blocks += length;
+        n -= length;
+    }
+
+    free(runs);
+}
+
+int allocate_blocks(LLFS* fs, int n, int goal, int* blocks, int reserve)
+{
+    /* Take n data blocks as one contiguous run if possible (starting at goal if
+       that's free), otherwise as few runs as possible, and set aside reserve more
+       for the indirect blocks that will map them. Returns 0 and takes nothing if
+       there aren't enough free data blocks. */
+    long long span = TRACE_BEGIN();
+    stats_add(STAT_ALLOCS, 1);
+    pthread_mutex_lock(&fs->locks->alloc);
+    int enough = enough_free_blocks(fs, n + reserve);
+    if (enough) {
+        take_blocks(fs, n, goal, blocks);
+        fs->reserved_blocks += reserve;
+    }
+    pthread_mutex_unlock(&fs->locks->alloc);
+    TRACE_END("allocate_blocks", span);
+    return enough;
+}
+
+void deallocate_block(LLFS* fs, int blockNum)
+{
+    /* A data block can't be reused before the transaction that frees it is committed
+       (a crash would bring back the file that still points to it) */
+    long long span = TRACE_BEGIN();
+    stats_add(STAT_ALLOCS, 1);
+    pthread_mutex_lock(&fs->locks->alloc);
+    if (blockNum < fs->data_start) mark_free(fs, blockNum);
+    else {
+        if (fs->num_pending == fs->max_pending) {
+            fs->max_pending = fs->max_pending ? 2 * fs->max_pending : 64;
+            fs->pending_free = (int*) realloc(fs->pending_free, fs->max_pending * sizeof(int));
+        }
+        fs->pending_free[fs->num_pending++] = blockNum;
+    }
+    pthread_mutex_unlock(&fs->locks->alloc);
+    TRACE_END("deallocate_block", span);
+}
+
+
+int allocate_inodes(LLFS* fs, int n, int* inode_ids)
+{
+    /* --- Next-fit over the inode map, the same way find_available_block() searches the bitmap.
+       All n are found in one sweep, or none is taken (returns 0). --- */
+    long long span = TRACE_BEGIN();
+    stats_add(STAT_ALLOCS, 1);
+    pthread_mutex_lock(&fs->locks->alloc);
+    int cursor = fs->next_fit[0], found = 0;
+    for (int i = next_bit(fs->inode_map, cursor, fs->num_inodes, 1); found < n && i < fs->num_inodes; ) {
+        inode_ids[found++] = i;
+        i = next_bit(fs->inode_map, i + 1, fs->num_inodes, 1);
+    }
+    for (int i = next_bit(fs->inode_map, 0, cursor, 1); found < n && i < cursor; ) {
+        inode_ids[found++] = i;
+        i = next_bit(fs->inode_map, i + 1, cursor, 1);
+    }
+    int enough = found == n; // or there aren't enough available inodes
+    for (int k = 0; enough && k < n; k++) {
+        int i = inode_ids[k];
+        fs->inode_map[i / 8] &= ~(0x80 >> (i % 8));
+        fs->next_fit[0] = i;
+
+        /* The metadata range of the bitmap tells which inode table blocks hold live inodes */
+        int blockNum = fs->inode_start + i / fs->inodes_per_block;
+        if (is_free(fs->bitmap, blockNum)) mark_used(fs, blockNum);
+
+        int inode_id = ROOT_INODE + i;
+        int in_use = 1;
+        memset(inode_ptr(fs, inode_id), 0, INODE_SIZE);
+        memcpy(inode_ptr(fs, inode_id) + 8, &in_use, 4);
+        dirty_inode(fs, inode_id);
+        inode_ids[k] = inode_id;
+    }
+    pthread_mutex_unlock(&fs->locks->alloc);
+    TRACE_END("allocate_inodes", span);
+    return enough;
+}
+
+int allocate_inode(LLFS* fs)
+{
+    int inode_id;
+    return allocate_inodes(fs, 1, &inode_id) ? inode_id : 0;
+}
+
+void free_inode(LLFS* fs, int inode_id)
+{
+    stats_add(STAT_ALLOCS, 1);
+    int i = inode_id - ROOT_INODE;
+    memset(inode_ptr(fs, inode_id), 0, INODE_SIZE);
+    dirty_inode(fs, inode_id);
+    pthread_mutex_lock(&fs->locks->alloc);
+    fs->inode_map[i / 8] |= 0x80 >> (i % 8);
+
+    /* --- Its inode table block is free again once none of its inodes are used --- */
+    int first = i - i % fs->inodes_per_block;
+    int end = (first + fs->inodes_per_block < fs->num_inodes) ? first + fs->inodes_per_block : fs->num_inodes;
+    if (next_bit(fs->inode_map, first, end, 0) == end) mark_free(fs, fs->inode_start + i / fs->inodes_per_block);
+    pthread_mutex_unlock(&fs->locks->alloc);
+}
+
+/* --- Metadata journal --- */
+
+static unsigned int journal_checksum(unsigned int hash, char* data, int length)
+{
+    for (int i = 0; i < length; i++) hash = (hash ^ (unsigned char) data[i]) * 16777619u; // FNV-1a
+    return hash;
+}
+
+static void journal_field(char* block, int offset, unsigned int value)
+{
+    memcpy(block + offset, &value, 4);
+}
+
+static unsigned int journal_get(char* block, int offset)
+{
+    unsigned int value;
+    memcpy(&value, block + offset, 4);
+    return value;
+}
+
+void journal_checkpoint(LLFS* fs)
+{
+    /* Once everything that was committed is at its home location the journal can start over
+       (commit_transaction() has written it, the flush and sync make sure it's there) */
+    long long span = TRACE_BEGIN();
+    flushDisk(fs->disk);
+    syncDisk(fs->disk);
+    char* header = (char*) calloc(fs->block_size, 1);
+    journal_field(header, 0, JOURNAL_MAGIC);
+    journal_field(header, 4, J_HEADER);
+    journal_field(header, 8, fs->journal_seq); // the first transaction to replay
+    writeBlocks(fs->disk, fs->journal_start, 1, header);
+    syncDisk(fs->disk);
+    free(header);
+    fs->journal_head = 1;
+    TRACE_END("journal_checkpoint", span);
+}
+
+static int journal_span(LLFS* fs, int count)
+{
+    /* Journal blocks a transaction of count blocks takes: a descriptor for every (bs - 16) / 4
+       of them followed by their images, then the commit block */
+    int capacity = (fs->block_size - 16) / 4;
+    return count + (count + capacity - 1) / capacity + 1;
+}
+
+static void journal_write(LLFS* fs, JournalBlock* blocks, int count)
+{
+    /* Descriptors, block images and commit block go out with one write and one sync,
+       the checksum in the commit block tells if the whole transaction made it */
+    int bs = fs->block_size;
+    int capacity = (bs - 16) / 4;
+    int span = journal_span(fs, count);
+    if (fs->journal_head + span > fs->journal_blocks) journal_checkpoint(fs);
+
+    char* buffer = (char*) calloc((size_t) span * bs, 1);
+    char* descriptor = buffer;
+    for (int done = 0, n; done < count; done += n) {
+        n = (count - done < capacity) ? count - done : capacity;
+        journal_field(descriptor, 0, JOURNAL_MAGIC);
+        journal_field(descriptor, 4, J_DESCRIPTOR);
+        journal_field(descriptor, 8, fs->journal_seq);
+        journal_field(descriptor, 12, n);
+        for (int i = 0; i < n; i++) {
+            journal_field(descriptor, 16 + 4 * i, blocks[done + i].blockNum);
+            memcpy(descriptor + (size_t) (i + 1) * bs, blocks[done + i].block, bs);
+        }
+        descriptor += (size_t) (n + 1) * bs;
+    }
+    char* commit = descriptor;
+    journal_field(commit, 0, JOURNAL_MAGIC);
+    journal_field(commit, 4, J_COMMIT);
+    journal_field(commit, 8, fs->journal_seq);
+    journal_field(commit, 12, journal_checksum(2166136261u, buffer, (span - 1) * bs));
+    writeBlocks(fs->disk, fs->journal_start + fs->journal_head, span, buffer);
+    syncDisk(fs->disk);
+    free(buffer);
+
+    fs->journal_head += span;
+    fs->journal_seq++;
+    if (fs->crash_after > 0 && --fs->crash_after == 0) failDisk(fs->disk);
+}
+
+static int inode_region(LLFS* fs, int inode_block)
+{
+    return (int) ((long long) inode_block * DIRTY_REGIONS / fs->inode_blocks);
+}
+
+static void mark_dirty_regions(LLFS* fs, unsigned long long regions)
+{
+    /* The superblock remembers which regions of the inode table changed since the last
+       clean unmount, so the mount after a crash only checks those. It's written before
+       the transaction that changes them and isn't journaled (it's only a hint). */
+    fs->dirty_regions = regions;
+    memcpy(fs->superblock + SB_DIRTY_REGIONS, &regions, 8);
+    writeBlocks(fs->disk, 0, 1, fs->superblock);
+    syncDisk(fs->disk);
+}
+
+static void commit_transaction(LLFS* fs)
+{
+    /* Log every metadata block changed since the last commit as one transaction, then
+       let the blocks go to their home locations. The journal lock is held exclusively,
+       so no operation is halfway through. */
+    long long span = TRACE_BEGIN();
+    int bs = fs->block_size;
+
+    /* --- Ordered: the file data the transaction points to reaches the disk first --- */
+    flushDisk(fs->disk);
+
+    /* --- The data blocks freed by this transaction become free in it --- */
+    pthread_mutex_lock(&fs->locks->alloc);
+    for (int i = 0; i < fs->num_pending; i++) mark_free(fs, fs->pending_free[i]);
+    fs->num_pending = 0;
+    pthread_mutex_unlock(&fs->locks->alloc);
+    fs->journal_ops = 0;
+    if (fs->txn_count + fs->journal_resident == 0) {
+        TRACE_END("commit_transaction", span); // nothing to log
+        return;
+    }
+    stats_add(STAT_COMMITS, 1);
+
+    /* --- Borrowed blocks first, then the dirty bitmap and inode table blocks --- */
+    int total = fs->txn_count + fs->journal_resident;
+    JournalBlock* blocks = (JournalBlock*) malloc(total * sizeof(JournalBlock));
+    int count = fs->txn_count;
+    memcpy(blocks, fs->txn, count * sizeof(JournalBlock));
+    for (int i = 0; i < fs->bitmap_blocks; i++) {
+        if (!fs->bitmap_dirty[i]) continue;
+        blocks[count].blockNum = 1 + i;
+        blocks[count++].block = fs->bitmap + (size_t) i * bs;
+        fs->bitmap_dirty[i] = 0;
+    }
+    unsigned long long regions = 0;
+    for (int i = 0; i < fs->inode_blocks; i++) {
+        if (!fs->inode_dirty[i]) continue;
+        blocks[count].blockNum = fs->inode_start + i;
+        blocks[count++].block = fs->inodes + (size_t) i * bs;
+        fs->inode_dirty[i] = 0;
+        regions |= 1ULL << inode_region(fs, i);
+    }
+    if (regions & ~fs->dirty_regions) mark_dirty_regions(fs, fs->dirty_regions | regions);
+
+    /* --- One commit record for the whole transaction: begin_operation() commits before it
+       could outgrow journal_limit. Only a single operation bigger than the whole journal
+       (fsck repairing a huge disk) can't be made atomic, it's written in parts. --- */
+    int part = count;
+    if (journal_span(fs, count) > fs->journal_blocks - 1) {
+        fprintf(stderr, "A transaction of %d blocks doesn't fit in the journal, it's committed in parts\n", count);
+        part = fs->journal_limit;
+    }
+    for (int done = 0, n; done < count; done += n) {
+        n = (count - done < part) ? count - done : part;
+        journal_write(fs, blocks + done, n);
+
+        /* Committed blocks go home now instead of staying dirty in the cache: a frame that's
+           still borrowed (by a reader, or changed again by the next transaction) can't be
+           flushed, and the next checkpoint would drop its only committed copy */
+        IOBatch* batch = startBatch(fs->disk);
+        for (int i = done; i < done + n; i++) batchWrite(batch, blocks[i].blockNum, 1, blocks[i].block);
+        if (!finishBatch(batch)) fprintf(stderr, "%s\n", "Failed to write committed blocks home");
+        for (int i = done; i < done + n && i < fs->txn_count; i++) putBlock(fs->disk, blocks[i].blockNum, blocks[i].block, 0);
+    }
+
+    fs->txn_count = 0;
+    fs->journal_resident = 0;
+    free(blocks);
+    TRACE_END("commit_transaction", span);
+}
+
+void journal_commit(LLFS* fs)
+{
+    pthread_rwlock_wrlock(&fs->locks->journal);
+    commit_transaction(fs);
+    pthread_rwlock_unlock(&fs->locks->journal);
+}
+
+static _Thread_local int operation_meta = 0; // what the calling thread's operation reserved
+
+int bitmap_span(LLFS* fs, int n)
+{
+    /* The bitmap blocks n allocated or freed blocks can be in */
+    return (n < fs->bitmap_blocks) ? n : fs->bitmap_blocks;
+}
+
+static int commit_due(LLFS* fs, int blocks, int meta)
+{
+    /* Group commit: one journal write for every JOURNAL_BATCH operations, or when blocks
+       data blocks are only available once the pending frees are committed, or before an
+       operation that can change meta more metadata blocks could make the transaction
+       outgrow journal_limit. Otherwise meta is reserved until end_operation(). */
+    pthread_mutex_lock(&fs->locks->alloc);
+    int short_of_blocks = blocks > 0 && !enough_free_blocks(fs, blocks) && fs->num_pending > 0;
+    int freed = bitmap_span(fs, fs->num_pending); // the bitmap blocks the pending frees change at the commit
+    pthread_mutex_lock(&fs->locks->txn);
+    int used = fs->txn_count + fs->journal_resident + freed + fs->journal_reserved;
+    int due = fs->journal_ops >= JOURNAL_BATCH || short_of_blocks || (used > 0 && used + meta > fs->journal_limit);
+    if (!due) {
+        fs->journal_reserved += meta;
+        operation_meta = meta;
+    }
+    pthread_mutex_unlock(&fs->locks->txn);
+    pthread_mutex_unlock(&fs->locks->alloc);
+    return due;
+}
+
+void begin_operation(LLFS* fs, int blocks, int meta)
+{
+    /* Every operation that changes metadata runs between begin_operation() and end_operation(),
+       commits only happen in between (blocks: the data blocks the operation may allocate,
+       meta: the most metadata blocks it can change, bitmap blocks included). An operation
+       that doesn't fit in what's left of the transaction waits for the next one, so a
+       transaction never has to be split. */
+    long long span = TRACE_BEGIN();
+    pthread_rwlock_rdlock(&fs->locks->journal);
+    while (commit_due(fs, blocks, meta)) {
+        pthread_rwlock_unlock(&fs->locks->journal);
+        journal_commit(fs);
+        pthread_rwlock_rdlock(&fs->locks->journal);
+    }
+    TRACE_END("begin_operation", span);
+}
+
+void end_operation(LLFS* fs)
+{
+    pthread_mutex_lock(&fs->locks->txn);
+    fs->journal_ops++;
+    fs->journal_reserved -= operation_meta;
+    operation_meta = 0;
+    int due = fs->journal_ops >= JOURNAL_BATCH;
+    pthread_mutex_unlock(&fs->locks->txn);
+    pthread_rwlock_unlock(&fs->locks->journal);
+    if (due) journal_commit(fs);
+}
+
+static void put_meta_block(LLFS* fs, int blockNum, char* block)
+{
+    /* A changed directory or indirect block stays borrowed from the block cache (so it
+       can't reach its home location) until it's committed. begin_operation() makes sure
+       the transaction has room for every block the operation changes. */
+    pthread_mutex_lock(&fs->locks->txn);
+    for (int i = 0; i < fs->txn_count; i++) {
+        if (fs->txn[i].blockNum != blockNum) continue;
+        if (block != fs->txn[i].block) memcpy(fs->txn[i].block, block, fs->block_size); // uncached disk
+        pthread_mutex_unlock(&fs->locks->txn);
+        putBlock(fs->disk, blockNum, block, 0);
+        return;
+    }
+    if (fs->txn_count == fs->max_txn) {
+        fs->max_txn *= 2;
+        fs->txn = (JournalBlock*) realloc(fs->txn, fs->max_txn * sizeof(JournalBlock));
+    }
+    fs->txn[fs->txn_count].blockNum = blockNum;
+    fs->txn[fs->txn_count++].block = block;
+    pthread_mutex_unlock(&fs->locks->txn);
+}
+
+int journal_replay(LLFS* fs)
+{
+    /* Copy the committed transactions to their home locations, returns how many there
+       were (-1 if there's no journal) */
+    int bs = fs->block_size;
+    char* header = (char*) malloc(bs);
+    readBlock(fs->disk, fs->journal_start, header);
+    if (journal_get(header, 0) != JOURNAL_MAGIC || journal_get(header, 4) != J_HEADER) {
+        fprintf(stderr, "%s\n", "The journal header is corrupted");
+        free(header);
+        return -1;
+    }
+    fs->journal_seq = journal_get(header, 8);
+    free(header);
+
+    int replayed = 0;
+    int capacity = (bs - 16) / 4;
+    char* descriptor = (char*) malloc(bs);
+    for (int pos = 1; pos + 2 <= fs->journal_blocks; replayed++) {
+        /* --- The descriptors of a transaction follow each other up to its commit block --- */
+        int end = pos;
+        for (;;) {
+            readBlock(fs->disk, fs->journal_start + end, descriptor);
+            unsigned int count = journal_get(descriptor, 12);
+            if (journal_get(descriptor, 0) != JOURNAL_MAGIC || journal_get(descriptor, 8) != fs->journal_seq) break;
+            if (journal_get(descriptor, 4) == J_COMMIT && end > pos) break;
+            if (journal_get(descriptor, 4) != J_DESCRIPTOR || count == 0 || count > capacity
+                || end + count + 1 >= fs->journal_blocks) break;
+            end += count + 1;
+        }
+        if (end == pos) break;
+
+        char* buffer = (char*) malloc((size_t) (end - pos + 1) * bs);
+        readBlocks(fs->disk, fs->journal_start + pos, buffer, (end - pos + 1) * bs);
+        char* commit = buffer + (size_t) (end - pos) * bs;
+        int complete = journal_get(commit, 0) == JOURNAL_MAGIC && journal_get(commit, 4) == J_COMMIT
+                       && journal_get(commit, 8) == fs->journal_seq
+                       && journal_get(commit, 12) == journal_checksum(2166136261u, buffer, (end - pos) * bs);
+        if (complete) {
+            for (char* d = buffer; d < commit; d += (size_t) (journal_get(d, 12) + 1) * bs) {
+                for (int i = 0; i < journal_get(d, 12); i++) {
+                    writeBlock(fs->disk, journal_get(d, 16 + 4 * i), d + (size_t) (i + 1) * bs);
+                }
+            }
+        }
+        free(buffer);
+        if (!complete) break;
+        pos = end + 1;
+        fs->journal_seq++;
+    }
+    free(descriptor);
+
+    if (replayed > 0) journal_checkpoint(fs);
+    fs->journal_head = 1;
+    return replayed;
+}
+
+/* --- The inode table (INODE_SIZE bytes per inode) stays in memory while mounted --- */
+
+int inode_size(LLFS* fs, int inode_id)
+{
+    int file_size;
+    memcpy(&file_size, inode_ptr(fs, inode_id), 4);
+    return file_size;
+}
+
+int inode_type(LLFS* fs, int inode_id)
+{
+    int file_type;
+    memcpy(&file_type, inode_ptr(fs, inode_id) + 4, 4);
+    return file_type;
+}
+
+static int inode_pointer(LLFS* fs, int inode_id, int i)
+{
+    int blockNum;
+    memcpy(&blockNum, (inode_ptr(fs, inode_id) + 12) + 4 * i, 4);
+    return blockNum;
+}
+
+static void set_inode_pointer(LLFS* fs, int inode_id, int i, int blockNum)
+{
+    memcpy((inode_ptr(fs, inode_id) + 12) + 4 * i, &blockNum, 4);
+    dirty_inode(fs, inode_id);
+}
+
+static int read_map(LLFS* fs, int mapBlock, int i)
+{
+    int blockNum;
+    char* block = getBlock(fs->disk, mapBlock);
+    memcpy(&blockNum, block + 4 * i, 4);
+    putBlock(fs->disk, mapBlock, block, 0);
+    return blockNum;
+}
+
+static void write_map(LLFS* fs, int mapBlock, int i, int blockNum)
+{
+    char* block = getBlock(fs->disk, mapBlock);
+    memcpy(block + 4 * i, &blockNum, 4);
+    put_meta_block(fs, mapBlock, block);
+}
+
+static int new_map_block(LLFS* fs)
+{
+    /* An indirect block, all of its pointers are 0 (block 0 is never a data block).
+       It was reserved by allocate_blocks() along with the blocks it maps. */
+    pthread_mutex_lock(&fs->locks->alloc);
+    fs->reserved_blocks--;
+    int blockNum = take_block(fs, 1);
+    pthread_mutex_unlock(&fs->locks->alloc);
+    char* block = getBlock(fs->disk, blockNum);
+    memset(block, 0, fs->block_size);
+    put_meta_block(fs, blockNum, block);
+    return blockNum;
+}
+
+int inode_block(LLFS* fs, int inode_id, int i)
+{
+    /* The i-th block of the file: direct pointers, then the single indirect block, then the double indirect one */
+    int direct = fs->direct_ptrs, ppb = fs->ptrs_per_block;
+    if (i < direct) return inode_pointer(fs, inode_id, i);
+    i -= direct;
+    if (i < ppb) return read_map(fs, inode_pointer(fs, inode_id, direct), i);
+    i -= ppb;
+    return read_map(fs, read_map(fs, inode_pointer(fs, inode_id, direct + 1), i / ppb), i % ppb);
+}
+
+void set_inode_size(LLFS* fs, int inode_id, int file_size)
+{
+    memcpy(inode_ptr(fs, inode_id), &file_size, 4);
+    dirty_inode(fs, inode_id);
+}
+
+void set_inode_type(LLFS* fs, int inode_id, int file_type)
+{
+    memcpy(inode_ptr(fs, inode_id) + 4, &file_type, 4);
+    dirty_inode(fs, inode_id);
+}
+
+void set_inode_block(LLFS* fs, int inode_id, int i, int blockNum)
+{
+    /* Indirect blocks are allocated on the way, out of the ones map_blocks_needed() counted */
+    int direct = fs->direct_ptrs, ppb = fs->ptrs_per_block;
+    if (i < direct) {
+        set_inode_pointer(fs, inode_id, i, blockNum);
+        return;
+    }
+    i -= direct;
+    int slot = (i < ppb) ? direct : direct + 1;
+    int mapBlock = inode_pointer(fs, inode_id, slot);
+    if (mapBlock == 0) {
+        mapBlock = new_map_block(fs);
+        set_inode_pointer(fs, inode_id, slot, mapBlock);
+    }
+    if (i >= ppb) {
+        i -= ppb;
+        int l1 = read_map(fs, mapBlock, i / ppb);
+        if (l1 == 0) {
+            l1 = new_map_block(fs);
+            write_map(fs, mapBlock, i / ppb, l1);
+        }
+        mapBlock = l1;
+        i %= ppb;
+    }
+    write_map(fs, mapBlock, i, blockNum);
+}
+
+int map_blocks_needed(LLFS* fs, int old_count, int new_count)
+{
+    /* Indirect blocks that growing a file from old_count to new_count blocks allocates */
+    int direct = fs->direct_ptrs, ppb = fs->ptrs_per_block, n = 0;
+    if (old_count <= direct && new_count > direct) n++;
+    if (new_count > direct + ppb) {
+        int old_l1 = (old_count > direct + ppb) ? (old_count - direct - 1) / ppb : 0;
+        int new_l1 = (new_count - direct - 1) / ppb;
+        if (old_l1 == 0) n++; // the double indirect block
+        n += new_l1 - old_l1;
+    }
+    return n;
+}
+
+void truncate_blocks(LLFS* fs, int inode_id, int old_count, int new_count)
+{
+    /* Free the blocks from new_count to old_count and the indirect blocks that don't map anything anymore */
+    int direct = fs->direct_ptrs, ppb = fs->ptrs_per_block;
+    for (int i = new_count; i < old_count; i++) deallocate_block(fs, inode_block(fs, inode_id, i));
+
+    if (old_count > direct && new_count <= direct) {
+        deallocate_block(fs, inode_pointer(fs, inode_id, direct));
+        set_inode_pointer(fs, inode_id, direct, 0);
+    }
+    if (old_count > direct + ppb) {
+        int mapBlock = inode_pointer(fs, inode_id, direct + 1);
+        int old_l1 = (old_count - direct - 1) / ppb;
+        int new_l1 = (new_count > direct + ppb) ? (new_count - direct - 1) / ppb : 0;
+        for (int k = new_l1; k < old_l1; k++) {
+            deallocate_block(fs, read_map(fs, mapBlock, k));
+            if (new_l1 > 0) write_map(fs, mapBlock, k, 0);
+        }
+        if (new_l1 == 0) {
+            deallocate_block(fs, mapBlock);
+            set_inode_pointer(fs, inode_id, direct + 1, 0);
+        }
+    }
+}
+
+static int write_file(LLFS* fs, char* data, int inode_id, int size)
+{
+    if (size < 0) {
+        fprintf(stderr, "Can't write %d bytes\n", size);
+        return 0;
+    }
+    int bs = fs->block_size;
+    char* buffer = (char*) malloc(bs);
+
+    /* --- Find where to begin to write --- */
+    int current_file_size = inode_size(fs, inode_id);
+    int dataBlockOffset = (int) (current_file_size / bs);
+    int fileBlockNumber = inode_block(fs, inode_id, dataBlockOffset);
+
+    /* Make sure it doesn't exceed the max file size (a file of n bytes uses n / block_size + 1 blocks) */
+    if ((long long) current_file_size + size > fs->max_file_size) {
+        fprintf(stderr, "Exceeded the max file size (%d)\n", fs->max_file_size);
+        free(buffer);
+        return 0;
+    }
+
+    /* Some useful numbers */
+    int last_block_bytes_left = bs - (current_file_size % bs);
+    int remaining_size = size - last_block_bytes_left;
+
+    /* --- Reserve all the new blocks at once, contiguous with the last block if possible --- */
+    int num_new_blocks = 0;
+    int* newDataBlocks = NULL;
+    if (remaining_size >= 0) {
+        num_new_blocks = ((int) (remaining_size / bs)) + 1;
+        int num_map_blocks = map_blocks_needed(fs, dataBlockOffset + 1, dataBlockOffset + 1 + num_new_blocks);
+        newDataBlocks = (int*) malloc(num_new_blocks * sizeof(int));
+        if (!allocate_blocks(fs, num_new_blocks, fileBlockNumber + 1, newDataBlocks, num_map_blocks)) {
+            fprintf(stderr, "%s\n", "No more data blocks available");
+            free(newDataBlocks);
+            free(buffer);
+            return 0;
+        }
+        // can't fail, the indirect blocks were reserved above
+        for (int i = 0; i < num_new_blocks; i++) set_inode_block(fs, inode_id, dataBlockOffset + 1 + i, newDataBlocks[i]);
+    }
+
+    /* --- Write file data to last block (in place) --- */
+    char* block = getBlock(fs->disk, fileBlockNumber);
+    if (remaining_size < 0) memcpy(block + (current_file_size % bs), data, size);
+    else                    memcpy(block + (current_file_size % bs), data, last_block_bytes_left);
+    if (inode_type(fs, inode_id) == 0) put_meta_block(fs, fileBlockNumber, block); // directory entries are journaled
+    else                               putBlock(fs->disk, fileBlockNumber, block, 1);
+
+    /* --- Write file data to new blocks, one request per contiguous run, all of them in flight together --- */
+    if (remaining_size >= 0) {
+        data += last_block_bytes_left; // remaining data
+        int full_blocks = remaining_size / bs;
+
+        IOBatch* batch = startBatch(fs->disk);
+        for (int i = 0, run; i < full_blocks; i += run) {
+            for (run = 1; i + run < full_blocks && newDataBlocks[i + run] == newDataBlocks[i] + run; run++);
+            batchWrite(batch, newDataBlocks[i], run, data);
+            data += (size_t) run * bs;
+        }
+        if (remaining_size % bs > 0) {
+            memset(buffer, 0, bs);
+            memcpy(buffer, data, remaining_size % bs);
+            batchWrite(batch, newDataBlocks[full_blocks], 1, buffer);
+        }
+        if (!finishBatch(batch)) fprintf(stderr, "Failed to write the data of inode %d\n", inode_id);
+        free(newDataBlocks);
+    }
+
+    /* --- Update file size and block status --- */
+    set_inode_size(fs, inode_id, current_file_size + size);
+
+    free(buffer);
+    return size;
+}
+
+int writeToFile(LLFS* fs, char* data, int inode_id, int size)
+{
+    long long span = TRACE_BEGIN();
+    int written = write_file(fs, data, inode_id, size);
+    TRACE_END("writeToFile", span);
+    return written;
+}
+
+int readFromFile(LLFS* fs, char* data, int inode_id, int size)
+{
+    return readFromFileAt(fs, data, inode_id, size, 0);
+}
+
+int readFromFileAt(LLFS* fs, char* data, int inode_id, int size, int offset)
+{
+    long long span = TRACE_BEGIN();
+    int bs = fs->block_size;
+
+    if (offset < 0 || size < 0) {
+        fprintf(stderr, "Can't read %d bytes at offset %d\n", size, offset);
+        offset = size = 0; // nothing is read
+    }
+
+    /* --- Find where to start and stop reading --- */
+    int current_file_size = inode_size(fs, inode_id);
+    int file_type = inode_type(fs, inode_id);
+    if (offset >= current_file_size) size = 0;
+    else if (current_file_size - offset < size) size = current_file_size - offset;
+    int firstDataBlock = offset / bs;
+    int lastDataBlock = (offset + size - 1) / bs;
+
+    /* --- Read file data, one request per run of physically contiguous blocks, all of them in flight together --- */
+    IOBatch* batch = startBatch(fs->disk);
+    int done = 0;
+    for (int i = firstDataBlock, run; done < size; i += run) {
+        int skip = (i == firstDataBlock) ? offset % bs : 0;
+        int length;
+
+        if (skip > 0 || file_type == 0) {
+            /* partial first block, or a directory block (metadata, keep it hot in the block cache) */
+            run = 1;
+            length = (size - done < bs - skip) ? size - done : bs - skip;
+            int blockNum = inode_block(fs, inode_id, i);
+            char* block = getBlock(fs->disk, blockNum);
+            memcpy(data + done, block + skip, length);
+            putBlock(fs->disk, blockNum, block, 0);
+        } else {
+            int first = inode_block(fs, inode_id, i);
+            for (run = 1; i + run <= lastDataBlock && inode_block(fs, inode_id, i + run) == first + run; run++);
+            length = (size - done < run * bs) ? size - done : run * bs;
+            batchRead(batch, first, data + done, length); // no bounce buffer
+        }
+        done += length;
+    }
+
+    finishBatch(batch);
+    TRACE_END("readFromFileAt", span);
+    return size;
+}
+
+static int write_file_at(LLFS* fs, char* data, int inode_id, int size, int offset)
+{
+    if (size < 0) {
+        fprintf(stderr, "Can't write %d bytes at offset %d\n", size, offset);
+        return 0;
+    }
+    int bs = fs->block_size;
+    int current_file_size = inode_size(fs, inode_id);
+
+    if (offset < 0 || offset > current_file_size) {
+        fprintf(stderr, "Offset %d is past the end of the file (%d bytes)\n", offset, current_file_size);
+        return 0;
+    }
+    if ((long long) offset + size > fs->max_file_size) {
+        fprintf(stderr, "Exceeded the max file size (%d)\n", fs->max_file_size);
+        return 0;
+    }
+
+    /* --- Overwrite the blocks that are already part of the file, in place --- */
+    int overwrite = (current_file_size - offset < size) ? current_file_size - offset : size;
+    int firstDataBlock = offset / bs;
+    int lastDataBlock = (offset + overwrite - 1) / bs;
+    IOBatch* batch = startBatch(fs->disk);
+    int done = 0;
+    for (int i = firstDataBlock, run; done < overwrite; i += run) {
+        int skip = (i == firstDataBlock) ? offset % bs : 0;
+        int length;
+
+        if (skip > 0 || overwrite - done < bs) {
+            /* partial block: modified in place */
+            run = 1;
+            length = (overwrite - done < bs - skip) ? overwrite - done : bs - skip;
+            int blockNum = inode_block(fs, inode_id, i);
+            char* block = getBlock(fs->disk, blockNum);
+            memcpy(block + skip, data + done, length);
+            if (inode_type(fs, inode_id) == 0) put_meta_block(fs, blockNum, block);
+            else                               putBlock(fs->disk, blockNum, block, 1);
+        } else {
+            int full_blocks = (overwrite - done) / bs;
+            int first = inode_block(fs, inode_id, i);
+            for (run = 1; run < full_blocks && i + run <= lastDataBlock && inode_block(fs, inode_id, i + run) == first + run; run++);
+            length = run * bs;
+            batchWrite(batch, first, run, data + done);
+        }
+        done += length;
+    }
+    if (!finishBatch(batch)) fprintf(stderr, "Failed to write the data of inode %d\n", inode_id);
+
+    /* --- Whatever goes past the end is appended --- */
+    if (size > overwrite && writeToFile(fs, data + overwrite, inode_id, size - overwrite) == 0) return 0;
+    return size;
+}
+
+int writeToFileAt(LLFS* fs, char* data, int inode_id, int size, int offset)
+{
+    long long span = TRACE_BEGIN();
+    int written = write_file_at(fs, data, inode_id, size, offset);
+    TRACE_END("writeToFileAt", span);
+    return written;
+}
+
+int get_file_size(LLFS* fs, int inode_id)
+{
+    return inode_size(fs, inode_id);
+}
+
+static unsigned int name_hash(char* name)
+{
+    unsigned int hash = 2166136261u; // FNV-1a
+    for (; *name != '\0'; name++) hash = (hash ^ (unsigned char) *name) * 16777619u;
+    return hash;
+}
+
+static void dir_index_grow(DirIndex* index)
+{
+    DirSlot* old = index->slots;
+    int old_slots = index->num_slots;
+    index->num_slots = old_slots ? old_slots * 2 : 16;
+    index->slots = (DirSlot*) calloc(index->num_slots, sizeof(DirSlot));
+    index->count = 0;
+    for (int i = 0; i < old_slots; i++) {
+        if (old[i].inode_id != 0) dir_index_insert(index, old[i].name, old[i].inode_id, old[i].offset);
+    }
+    free(old);
+}
+
+void dir_index_insert(DirIndex* index, char* name, int inode_id, int offset)
+{
+    if (2 * (index->count + 1) > index->num_slots) dir_index_grow(index);
+
+    unsigned int hash = name_hash(name);
+    int i = hash & (index->num_slots - 1);
+    while (index->slots[i].inode_id != 0) i = (i + 1) & (index->num_slots - 1);
+    index->slots[i].inode_id = inode_id;
+    index->slots[i].offset = offset;
+    index->slots[i].hash = hash;
+    memcpy(index->slots[i].name, name, strlen(name) + 1);
+    index->count++;
+}
+
+DirSlot* dir_index_lookup(DirIndex* index, char* name)
+{
+    if (index->count == 0) return NULL;
+    unsigned int hash = name_hash(name);
+    for (int i = hash & (index->num_slots - 1); index->slots[i].inode_id != 0; i = (i + 1) & (index->num_slots - 1)) {
+        if (index->slots[i].hash == hash && strcmp(index->slots[i].name, name) == 0) return &index->slots[i];
+    }
+    return NULL;
+}
+
+void dir_index_remove(DirIndex* index, char* name)
+{
+    DirSlot* slot = dir_index_lookup(index, name);
+    if (slot == NULL) return;
+
+    /* --- Linear probing: shift back the entries that probed past the hole --- */
+    int mask = index->num_slots - 1;
+    int hole = slot - index->slots;
+    for (int i = (hole + 1) & mask; index->slots[i].inode_id != 0; i = (i + 1) & mask) {
+        int home = index->slots[i].hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            index->slots[hole] = index->slots[i];
+            hole = i;
+        }
+    }
+    index->slots[hole].inode_id = 0;
+    index->count--;
+}
+
+DirIndex* get_dir_index(LLFS* fs, int directory_inode)
+{
+    /* Built from the directory file on first use (the directory is locked, maybe shared
+       by several readers), then kept up to date by createFile/deleteFile */
+    long long span = TRACE_BEGIN();
+    pthread_mutex_lock(&fs->locks->index);
+    if (fs->dir_index[directory_inode] != NULL) {
+        DirIndex* index = fs->dir_index[directory_inode];
+        pthread_mutex_unlock(&fs->locks->index);
+        TRACE_END("get_dir_index", span);
+        return index;
+    }
+
+    stats_add(STAT_DIR_SCANS, 1);
+    int bs = fs->block_size;
+    DirIndex* index = (DirIndex*) calloc(1, sizeof(DirIndex));
+    int size = get_file_size(fs, directory_inode);
+    for (int offset = 0; offset < size; offset += bs) {
+        int blockNum = inode_block(fs, directory_inode, offset / bs);
+        char* block = getBlock(fs->disk, blockNum); // scanned in place
+        for (int i = 0; i < bs && offset + i < size; i += DIR_ENTRY_SIZE) {
+            int inode_id;
+            memcpy(&inode_id, block + i, 4);
+            dir_index_insert(index, block + i + 4, inode_id, offset + i);
+        }
+        putBlock(fs->disk, blockNum, block, 0);
+    }
+
+    fs->dir_index[directory_inode] = index;
+    pthread_mutex_unlock(&fs->locks->index);
+    TRACE_END("get_dir_index", span);
+    return index;
+}
+
+void drop_dir_index(LLFS* fs, int directory_inode)
+{
+    pthread_mutex_lock(&fs->locks->index);
+    DirIndex* index = fs->dir_index[directory_inode];
+    fs->dir_index[directory_inode] = NULL;
+    pthread_mutex_unlock(&fs->locks->index);
+    if (index == NULL) return;
+    free(index->slots);
+    free(index);
+}
+
+int find_inode_scan(LLFS* fs, char* name, int directory_inode)
+{
+    /* Find the inode of a file in a given directory by reading all of its entries */
+    stats_add(STAT_DIR_SCANS, 1);
+
+    int bs = fs->block_size;
+    int size = get_file_size(fs, directory_inode);
+    int inode_id = 0;
+    for (int offset = 0; offset < size && inode_id == 0; offset += bs) {
+        int blockNum = inode_block(fs, directory_inode, offset / bs);
+        char* block = getBlock(fs->disk, blockNum); // scanned in place
+        for(int i = 0; i < bs && offset + i < size; i += DIR_ENTRY_SIZE) {
+            if (memcmp(block + i + 4, name, strlen(name) + 1) == 0) {
+                memcpy(&inode_id, block + i, 4);
+                break;
+            }
+        }
+        putBlock(fs->disk, blockNum, block, 0);
+    }
+
+    return inode_id;
+}
+
+int find_inode(LLFS* fs, char* name, int directory_inode)
+{
+    /* Find the inode of a file in a given directory */
+
+    DirSlot* slot = dir_index_lookup(get_dir_index(fs, directory_inode), name);
+    int inode_id = (slot == NULL) ? 0 : slot->inode_id;
+
+#ifdef CHECK_DIR_INDEX
+    if (inode_id != find_inode_scan(fs, name, directory_inode)) {
+        fprintf(stderr, "Directory index of inode %d is out of date for %s\n", directory_inode, name);
+        abort();
+    }
+#endif
+    return inode_id;
+}
+
+int is_flat_file(LLFS* fs, int inode_id)
+{
+    return inode_type(fs, inode_id);
+}
+
+static Dentry* dentry_slot(LLFS* fs, char* name, int directory_inode, unsigned int* hash)
+{
+    /* The slot comes back with its stripe locked */
+    *hash = name_hash(name) ^ (directory_inode * 2654435761u);
+    int i = *hash & (DCACHE_SIZE - 1);
+    pthread_mutex_lock(&fs->locks->dcache[i % DCACHE_LOCKS]);
+    return &fs->dcache[i];
+}
+
+static void release_dentry(LLFS* fs, Dentry* dentry)
+{
+    pthread_mutex_unlock(&fs->locks->dcache[(dentry - fs->dcache) % DCACHE_LOCKS]);
+}
+
+void cache_dentry(LLFS* fs, char* name, int directory_inode, int inode_id, int type)
+{
+    if (strlen(name) > MAX_NAME_LENGTH) return; // can't be in a directory anyways
+
+    unsigned int hash;
+    Dentry* dentry = dentry_slot(fs, name, directory_inode, &hash);
+    dentry->valid = 1;
+    dentry->hash = hash;
+    dentry->directory_inode = directory_inode;
+    dentry->inode_id = inode_id;
+    dentry->type = type;
+    memcpy(dentry->name, name, strlen(name) + 1);
+    release_dentry(fs, dentry);
+}
+
+void invalidate_dentries(LLFS* fs, int directory_inode)
+{
+    /* Forget everything cached under a directory (when it's removed) */
+    for (int i = 0; i < DCACHE_SIZE; i++) {
+        pthread_mutex_lock(&fs->locks->dcache[i % DCACHE_LOCKS]);
+        if (fs->dcache[i].directory_inode == directory_inode) fs->dcache[i].valid = 0;
+        pthread_mutex_unlock(&fs->locks->dcache[i % DCACHE_LOCKS]);
+    }
+}
+
+int lookup_dentry(LLFS* fs, char* name, int directory_inode, int* type)
+{
+    /* Like find_inode but also gives the file type, remembering both (or that
+       the name doesn't exist) in the dentry cache. The directory is locked. */
+    unsigned int hash;
+    Dentry* dentry = dentry_slot(fs, name, directory_inode, &hash);
+    if (dentry->valid && dentry->hash == hash && dentry->directory_inode == directory_inode
+        && strcmp(dentry->name, name) == 0) {
+        *type = dentry->type;
+        int inode_id = dentry->inode_id;
+        release_dentry(fs, dentry);
+        return inode_id;
+    }
+    release_dentry(fs, dentry);
+
+    stats_add(STAT_DCACHE_MISSES, 1);
+    int inode_id = find_inode(fs, name, directory_inode);
+    *type = (inode_id == 0) ? -1 : is_flat_file(fs, inode_id);
+    cache_dentry(fs, name, directory_inode, inode_id, *type);
+    return inode_id;
+}
+
+void lock_inode(LLFS* fs, int inode_id, int exclusive)
+{
+    if (exclusive) pthread_rwlock_wrlock(&fs->locks->inodes[inode_id - ROOT_INODE]);
+    else           pthread_rwlock_rdlock(&fs->locks->inodes[inode_id - ROOT_INODE]);
+}
+
+void unlock_inode(LLFS* fs, int inode_id)
+{
+    pthread_rwlock_unlock(&fs->locks->inodes[inode_id - ROOT_INODE]);
+}
+
+int walk_path(LLFS* fs, char* _path, int exclusive)
+{
+    /* The directory comes back locked (exclusive or shared), nothing is locked if it
+       doesn't exist. The directories on the way are only locked one after the other. */
+    long long span = TRACE_BEGIN();
+    char* path = (char*) malloc(strlen(_path) + 1);
+    memcpy(path, _path, strlen(_path) + 1);
+
+    int directory_inode = ROOT_INODE; // start walking from root
+    int file_type;
+    char* save;
+    char* token = strtok_r(path, "/", &save);
+    lock_inode(fs, ROOT_INODE, exclusive && token == NULL);
+    while(token != NULL) {
+        char* next = strtok_r(NULL, "/", &save);
+        stats_add(STAT_PATH_COMPONENTS, 1);
+        int inode_id = lookup_dentry(fs, token, directory_inode, &file_type);
+        if (inode_id == 0 || file_type) {
+            if (inode_id == 0) fprintf(stderr, "Directory named %s doesn't exist in %s\n", token, path);
+            else               fprintf(stderr, "%s is not a directory\n", token);
+            unlock_inode(fs, directory_inode);
+            directory_inode = 0;
+            break;
+        }
+        lock_inode(fs, inode_id, exclusive && next == NULL);
+        unlock_inode(fs, directory_inode);
+        directory_inode = inode_id;
+        token = next;
+    }
+
+    free(path);
+    TRACE_END("walk_path", span);
+    return directory_inode;
+}
+
+int find_file_inode(LLFS* fs, char* name, char* path, int exclusive)
+{
+    /* The file comes back locked (exclusive or shared), nothing is locked if it doesn't exist */
+    int directory_inode = walk_path(fs, path, 0); // dir that contains the file
+    if (directory_inode == 0) return 0;
+    int file_type;
+    int inode_id = lookup_dentry(fs, name, directory_inode, &file_type);
+    if (inode_id != 0) lock_inode(fs, inode_id, exclusive);
+    unlock_inode(fs, directory_inode);
+    return inode_id;
+}
+
+int find_file_inode_with_parent(LLFS* fs, char* name, char* path, int* parent_dir_inode)
+{
+    /* Both come back locked exclusively, nothing is locked if the file doesn't exist */
+    int directory_inode = walk_path(fs, path, 1); // dir that contains the file
+    if (directory_inode == 0) return 0;
+    int file_type;
+    int inode_id = lookup_dentry(fs, name, directory_inode, &file_type);
+    if (inode_id == 0) {
+        unlock_inode(fs, directory_inode);
+        return 0;
+    }
+    lock_inode(fs, inode_id, 1);
+    *parent_dir_inode = directory_inode;
+    return inode_id;
+}
+
+int name_collision(LLFS* fs, int directory_inode, char* name)
+{
+    if (find_inode(fs, name, directory_inode) == 0) {
+        return 0;
+    } else {
+        fprintf(stderr, "There's a name collision with %s\n", name);
+        return 1;
+    }
+}
+
+int file_system_check(LLFS* fs)
+{
+    /* Whatever was committed to the journal before a crash is redone, the transaction
+       that was being written (if any) is ignored as a whole */
+    int replayed = journal_replay(fs);
+    if (replayed > 0) fprintf(stderr, "Replayed %d transaction(s) from the journal\n", replayed);
+    return replayed >= 0;
+}
+
+/* --- Consistency check ---
+   LLFS_Fsck() walks the directory tree from the root, rebuilds the bitmap from one pass
+   over the resident inode table and compares the two 64 bits at a time. check_dirty_regions()
+   is the quick check done at mount, of the inodes the superblock marks as changed. */
+
+typedef struct Fsck Fsck;
+struct Fsck {
+    LLFS* fs;
+    int   repair;
+    int   problems;
+    char* expected; // the bitmap the inodes call for, NULL for the quick check
+    char* reached;  // by inode_id - ROOT_INODE, found in the tree, NULL for the quick check
+};
+
+static void report(Fsck* check, const char* format, ...)
+{
+    if (check->problems++ >= FSCK_REPORTS) return;
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+static int in_data_region(LLFS* fs, int blockNum)
+{
+    return blockNum >= fs->data_start && blockNum < fs->num_blocks;
+}
+
+static int inode_in_use(LLFS* fs, int inode_id)
+{
+    int in_use;
+    memcpy(&in_use, inode_ptr(fs, inode_id) + 8, 4);
+    return in_use != 0;
+}
+
+static int claim_block(Fsck* check, int inode_id, int blockNum)
+{
+    /* Returns 0 if the block is off the data region, it isn't read then */
+    LLFS* fs = check->fs;
+    if (!in_data_region(fs, blockNum)) {
+        report(check, "Inode %d points to block %d, outside the data region\n", inode_id, blockNum);
+        return 0;
+    }
+    if (check->expected == NULL) {
+        if (is_free(fs->bitmap, blockNum)) report(check, "Block %d of inode %d is marked free\n", blockNum, inode_id);
+    } else if (!is_free(check->expected, blockNum)) {
+        report(check, "Block %d is used more than once (again by inode %d)\n", blockNum, inode_id);
+    } else check->expected[blockNum / 8] &= ~(0x80 >> (blockNum % 8));
+    return 1;
+}
+
+static void claim_map(Fsck* check, int inode_id, int mapBlock, int n)
+{
+    /* An indirect block and the first n blocks it maps */
+    LLFS* fs = check->fs;
+    if (!claim_block(check, inode_id, mapBlock)) return;
+    char* block = getBlock(fs->disk, mapBlock);
+    for (int i = 0; i < n; i++) {
+        int blockNum;
+        memcpy(&blockNum, block + 4 * i, 4);
+        claim_block(check, inode_id, blockNum);
+    }
+    putBlock(fs->disk, mapBlock, block, 0);
+}
+
+static int check_inode(Fsck* check, int inode_id)
+{
+    /* Type, size and every block of the file. Returns 0 if it's too broken to follow. */
+    LLFS* fs = check->fs;
+    int direct = fs->direct_ptrs, ppb = fs->ptrs_per_block;
+    int type = inode_type(fs, inode_id), size = inode_size(fs, inode_id);
+    if (type != 0 && type != 1) {
+        report(check, "Inode %d has an unknown type %d\n", inode_id, type);
+        return 0;
+    }
+    if (size < 0 || size > fs->max_file_size) {
+        report(check, "Inode %d has a bad size %d\n", inode_id, size);
+        return 0;
+    }
+
+    int count = size / fs->block_size + 1;
+    for (int i = 0; i < count && i < direct; i++) claim_block(check, inode_id, inode_pointer(fs, inode_id, i));
+    if (count > direct) claim_map(check, inode_id, inode_pointer(fs, inode_id, direct), (count - direct < ppb) ? count - direct : ppb);
+    if (count > direct + ppb) {
+        int mapBlock = inode_pointer(fs, inode_id, direct + 1);
+        if (!claim_block(check, inode_id, mapBlock)) return 1;
+        for (int k = 0, rest = count - direct - ppb; rest > 0; k++, rest -= ppb) {
+            claim_map(check, inode_id, read_map(fs, mapBlock, k), (rest < ppb) ? rest : ppb);
+        }
+    }
+    return 1;
+}
+
+static int checked_block(LLFS* fs, int inode_id, int i)
+{
+    /* inode_block() with every pointer on the way checked, 0 if one is off the data region */
+    int direct = fs->direct_ptrs, ppb = fs->ptrs_per_block;
+    if (i < direct) return in_data_region(fs, inode_pointer(fs, inode_id, i)) ? inode_pointer(fs, inode_id, i) : 0;
+    i -= direct;
+    int mapBlock = inode_pointer(fs, inode_id, (i < ppb) ? direct : direct + 1);
+    if (i >= ppb) {
+        i -= ppb;
+        if (!in_data_region(fs, mapBlock)) return 0;
+        mapBlock = read_map(fs, mapBlock, i / ppb);
+        i %= ppb;
+    }
+    if (!in_data_region(fs, mapBlock)) return 0;
+    int blockNum = read_map(fs, mapBlock, i);
+    return in_data_region(fs, blockNum) ? blockNum : 0;
+}
+
+static void rewrite_directory(LLFS* fs, int directory_inode, char* entries, int new_size)
+{
+    /* Only the good entries are kept, packed at the start the way remove_inode() keeps them */
+    int bs = fs->block_size;
+    int size = inode_size(fs, directory_inode);
+    lock_inode(fs, directory_inode, 1);
+    for (int offset = 0; offset < new_size; offset += bs) {
+        int blockNum = inode_block(fs, directory_inode, offset / bs);
+        char* block = getBlock(fs->disk, blockNum);
+        memcpy(block, entries + offset, (new_size - offset < bs) ? new_size - offset : bs);
+        put_meta_block(fs, blockNum, block);
+    }
+    truncate_blocks(fs, directory_inode, size / bs + 1, new_size / bs + 1);
+    set_inode_size(fs, directory_inode, new_size);
+    drop_dir_index(fs, directory_inode);
+    invalidate_dentries(fs, directory_inode);
+    unlock_inode(fs, directory_inode);
+}
+
+static int check_directory(Fsck* check, int directory_inode, int* queue, int* queued)
+{
+    /* Every entry has a name, once, and an inode in use that (for the full check) no other
+       entry has. The directories it holds are queued. Returns 0 if it couldn't be read whole. */
+    LLFS* fs = check->fs;
+    int bs = fs->block_size;
+    int size = inode_size(fs, directory_inode);
+    if (size < 0 || size > fs->max_file_size) return 0; // check_inode() tells
+
+    int readable = 1;
+    char* entries = (char*) malloc((size_t) size + bs);
+    for (int offset = 0; offset < size; offset += bs) {
+        int blockNum = checked_block(fs, directory_inode, offset / bs);
+        if (blockNum == 0) {
+            report(check, "Directory inode %d can't be read past byte %d\n", directory_inode, offset);
+            readable = 0;
+            size = offset;
+            break;
+        }
+        char* block = getBlock(fs->disk, blockNum);
+        memcpy(entries + offset, block, bs);
+        putBlock(fs->disk, blockNum, block, 0);
+    }
+
+    int kept = 0, bad = size % DIR_ENTRY_SIZE != 0;
+    if (bad) report(check, "Directory inode %d ends with a partial entry\n", directory_inode);
+    DirIndex seen = { 0, 0, NULL };
+    for (int offset = 0; offset + DIR_ENTRY_SIZE <= size; offset += DIR_ENTRY_SIZE) {
+        char* entry = entries + offset;
+        char* name = entry + 4;
+        int inode_id;
+        memcpy(&inode_id, entry, 4);
+
+        char* problem = NULL;
+        if (name[0] == '\0' || memchr(name, '\0', DIR_ENTRY_SIZE - 4) == NULL) problem = "has a bad name";
+        else if (inode_id <= ROOT_INODE || inode_id >= ROOT_INODE + fs->num_inodes) problem = "points outside the inode table";
+        else if (!inode_in_use(fs, inode_id)) problem = "points to a free inode";
+        else if (dir_index_lookup(&seen, name) != NULL) problem = "repeats a name";
+        else if (check->reached != NULL && check->reached[inode_id - ROOT_INODE]) problem = "points to an inode found elsewhere";
+        if (problem != NULL) {
+            report(check, "Entry %d of directory inode %d %s\n", offset / DIR_ENTRY_SIZE, directory_inode, problem);
+            bad = 1;
+            continue;
+        }
+
+        dir_index_insert(&seen, name, inode_id, offset);
+        if (check->reached != NULL) {
+            check->reached[inode_id - ROOT_INODE] = 1;
+            if (inode_type(fs, inode_id) == 0) queue[(*queued)++] = inode_id;
+        }
+        memmove(entries + (size_t) kept * DIR_ENTRY_SIZE, entry, DIR_ENTRY_SIZE);
+        kept++;
+    }
+    free(seen.slots);
+
+    if (bad && readable && check->repair) rewrite_directory(fs, directory_inode, entries, kept * DIR_ENTRY_SIZE);
+    free(entries);
+    return readable;
+}
+
+static void check_tree(Fsck* check)
+{
+    /* Breadth first from the root, then the inodes in use that no directory holds */
+    LLFS* fs = check->fs;
+    if (!inode_in_use(fs, ROOT_INODE) || inode_type(fs, ROOT_INODE) != 0) {
+        report(check, "The root directory (inode %d) is missing\n", ROOT_INODE);
+        return;
+    }
+    int* queue = (int*) malloc(fs->num_inodes * sizeof(int));
+    int head = 0, queued = 0, whole = 1;
+    check->reached[0] = 1;
+    queue[queued++] = ROOT_INODE;
+    while (head < queued) whole &= check_directory(check, queue[head++], queue, &queued);
+    free(queue);
+
+    for (int i = 1; i < fs->num_inodes; i++) {
+        int inode_id = ROOT_INODE + i;
+        if (check->reached[i] || !inode_in_use(fs, inode_id)) continue;
+        report(check, "Inode %d is in use but in no directory\n", inode_id);
+
+        /* Freed unless part of the tree couldn't be read (it may be in there), its blocks
+           are then leaked and compare_bitmaps() frees them */
+        if (!check->repair || !whole) continue;
+        if (inode_type(fs, inode_id) == 0) {
+            drop_dir_index(fs, inode_id);
+            invalidate_dentries(fs, inode_id);
+        }
+        free_inode(fs, inode_id);
+    }
+}
+
+static void check_inodes(Fsck* check)
+{
+    /* One pass over the inode table: the bitmap that the inodes in use call for */
+    LLFS* fs = check->fs;
+    char* expected = check->expected;
+    memset(expected, 0, (size_t) fs->bitmap_blocks * fs->block_size);
+    for (int bit = fs->inode_start; bit < fs->journal_start; bit++) expected[bit / 8] |= 0x80 >> (bit % 8);
+    for (int bit = fs->data_start; bit < fs->num_blocks; bit++) expected[bit / 8] |= 0x80 >> (bit % 8);
+
+    for (int i = 0; i < fs->num_inodes; i++) {
+        int inode_id = ROOT_INODE + i;
+        int in_use = inode_in_use(fs, inode_id);
+        if (in_use == is_free(fs->inode_map, i)) {
+            report(check, "Inode %d is %s in the inode map\n", inode_id, in_use ? "free" : "used");
+            if (check->repair) {
+                pthread_mutex_lock(&fs->locks->alloc);
+                fs->inode_map[i / 8] ^= 0x80 >> (i % 8);
+                pthread_mutex_unlock(&fs->locks->alloc);
+            }
+        }
+        if (!in_use) continue;
+        int blockNum = fs->inode_start + i / fs->inodes_per_block;
+        expected[blockNum / 8] &= ~(0x80 >> (blockNum % 8));
+        check_inode(check, inode_id);
+    }
+}
+
+static void compare_bitmaps(Fsck* check)
+{
+    /* A block used on the disk that no inode calls for is leaked, one an inode calls for
+       that's marked free would be handed out again */
+    LLFS* fs = check->fs;
+    int words = fs->bitmap_blocks * (fs->block_size / 8);
+    long long leaked = 0, unmarked = 0;
+    pthread_mutex_lock(&fs->locks->alloc);
+    for (int w = 0; w < words; w++) {
+        unsigned long long have = load_bitmap_word(fs->bitmap + 8 * (size_t) w);
+        unsigned long long want = load_bitmap_word(check->expected + 8 * (size_t) w);
+        if (have == want) continue;
+        leaked += __builtin_popcountll(want & ~have);
+        unmarked += __builtin_popcountll(have & ~want);
+        for (unsigned long long diff = have ^ want; diff != 0; ) {
+            int bit = __builtin_clzll(diff);
+            diff &= ~(0x8000000000000000ULL >> bit);
+            report(check, "Block %d is %s\n", w * 64 + bit, (want << bit) >> 63 ? "used by no file" : "used but marked free");
+        }
+        if (check->repair) {
+            memcpy(fs->bitmap + 8 * (size_t) w, check->expected + 8 * (size_t) w, 8);
+            dirty_bitmap(fs, w * 64);
+        }
+    }
+    if (check->repair) fs->free_blocks = count_free_blocks(fs);
+    pthread_mutex_unlock(&fs->locks->alloc);
+    if (leaked + unmarked > 0) fprintf(stderr, "%lld leaked block(s), %lld used but marked free\n", leaked, unmarked);
+}
+
+int check_dirty_regions(LLFS* fs)
+{
+    /* The quick check at mount, of the inodes in the regions changed since the last clean
+       unmount: their blocks are in the data region and marked used, the directories among
+       them hold valid entries. Leaked blocks and blocks used twice take LLFS_Fsck(). */
+    Fsck check = { fs, 0, 0, NULL, NULL };
+    for (int i = 0; i < fs->num_inodes; i++) {
+        int inode_id = ROOT_INODE + i;
+        if (!((fs->dirty_regions >> inode_region(fs, i / fs->inodes_per_block)) & 1) || !inode_in_use(fs, inode_id)) continue;
+        if (check_inode(&check, inode_id) && inode_type(fs, inode_id) == 0) check_directory(&check, inode_id, NULL, NULL);
+    }
+    if (check.problems > 0) {
+        fprintf(stderr, "Found %d problem(s) in what changed since the last clean unmount, run fsck\n", check.problems);
+    }
+    return check.problems;
+}
+
+static int create_inode(LLFS* fs, char* name, int type, int directory_inode)
+{
+    /* --- Allocate blocks (the data block, the parent's next block and its indirect blocks at most) --- */
+    int inode_id = allocate_inode(fs);
+    if (inode_id == 0) {
+        fprintf(stderr, "%s\n", "No more inode blocks available");
+        return 0;
+    }
+
+    int dataBlock1 = find_available_block(fs, 1);
+    if (dataBlock1 == 0) {
+        fprintf(stderr, "%s\n", "No more data blocks available");
+        free_inode(fs, inode_id);
+        return 0;
+    }
+
+    /* --- Insert default inode data --- */
+    set_inode_size(fs, inode_id, 0);
+    set_inode_type(fs, inode_id, type); // 0 for directory, 1 for flat file
+    set_inode_block(fs, inode_id, 0, dataBlock1);
+
+    /* --- Create a dir entry in the given dir --- */
+    if (directory_inode != 0) { // root dir doesn't need the code below
+        char* dir_entry = (char*) calloc(DIR_ENTRY_SIZE, 1);
+        memcpy(dir_entry, &inode_id, 4);
+        memcpy(dir_entry + 4, name, strlen(name) + 1);
+        int offset = get_file_size(fs, directory_inode);
+        if (writeToFile(fs, dir_entry, directory_inode, DIR_ENTRY_SIZE) == 0) { // create a dir entry in root.
+            free(dir_entry);
+            free_inode(fs, inode_id);
+            deallocate_block(fs, dataBlock1);
+            return 0;
+        }
+        dir_index_insert(get_dir_index(fs, directory_inode), name, inode_id, offset);
+        cache_dentry(fs, name, directory_inode, inode_id, type);
+        free(dir_entry);
+    }
+    return inode_id;
+}
+
+/* --- What an operation can change, for begin_operation() --- */
+
+int create_meta(LLFS* fs, int n)
+{
+    /* Creating n files in one directory: an inode table block each and the directory's,
+       its last block and indirect blocks, and the bitmap blocks of the inode table blocks,
+       data blocks, new directory blocks and indirect blocks */
+    int dir_blocks = n * DIR_ENTRY_SIZE / fs->block_size + 1;
+    int map_blocks = dir_blocks / fs->ptrs_per_block + 3;
+    return n + 2 + map_blocks + bitmap_span(fs, 2 * n + dir_blocks + map_blocks);
+}
+
+int delete_meta(LLFS* fs, int n, int blocks)
+{
+    /* Removing n files with blocks data and indirect blocks between them from one directory:
+       an inode table block each and the directory's, the directory blocks of their entries
+       and of the last entries moved into them, its double indirect block, and the bitmap
+       blocks of the files' blocks, their inode table blocks and the directory blocks freed */
+    int dir_blocks = n * DIR_ENTRY_SIZE / fs->block_size + 1;
+    int map_blocks = dir_blocks / fs->ptrs_per_block + 2;
+    return 3 * n + 2 + bitmap_span(fs, blocks + n + dir_blocks + map_blocks);
+}
+
+static int file_blocks(LLFS* fs, int inode_id)
+{
+    /* The data and indirect blocks removing the file frees */
+    int count = inode_size(fs, inode_id) / fs->block_size + 1;
+    return count + map_blocks_needed(fs, 0, count);
+}
+
+int write_meta(LLFS* fs, int size)
+{
+    /* Writing size bytes: the inode table block, the partial blocks (journaled for a
+       directory), the indirect blocks filled or allocated, and the bitmap blocks of the
+       new blocks */
+    int blocks = size / fs->block_size + 2;
+    int map_blocks = 2 * (blocks / fs->ptrs_per_block + 2);
+    return 3 + map_blocks + bitmap_span(fs, blocks + map_blocks);
+}
+
+static int create_file(LLFS* fs, char* name, int type, char* path)
+{
+    if (strlen(name) > MAX_NAME_LENGTH) {
+        fprintf(stderr, "The name %s is longer than %d characters\n", name, MAX_NAME_LENGTH);
+        return 0;
+    }
+
+    /* --- The parent dir stays locked until the entry is in it (the root dir is created
+       by FormatLLFS, when nothing else can run) --- */
+    int is_root = memcmp(name, "/", 2) == 0;
+    int inode_id = 0, directory_inode = 0;
+    begin_operation(fs, 4, create_meta(fs, 1));
+    if (!is_root) directory_inode = walk_path(fs, path, 1);
+    if (is_root || (directory_inode != 0 && !name_collision(fs, directory_inode, name))) {
+        inode_id = create_inode(fs, name, type, directory_inode);
+    }
+    if (directory_inode != 0) unlock_inode(fs, directory_inode);
+    end_operation(fs);
+    return inode_id;
+}
+
+int createFile(LLFS* fs, char* name, int type, char* path)
+{
+    long long span = TRACE_BEGIN();
+    int inode_id = create_file(fs, name, type, path);
+    TRACE_END("createFile", span);
+    return inode_id;
+}
+
+static int remove_inode(LLFS* fs, char* name, int type, int inode_id, int parent_dir_inode)
+{
+    int bs = fs->block_size;
+    int file_size = inode_size(fs, inode_id);
+    int file_type = inode_type(fs, inode_id);
+
+    /* --- Check if it's a directory or a flat file --- */
+    if (type == 0) {
+        if (file_type != type) {
+            fprintf(stderr, "%s is not a directory\n", name);
+            return 0;
+        }
+        if (file_size != 0) {
+            fprintf(stderr, "The directory %s contains files\n", name);
+            return 0;
+        }
+    } else {
+        if (file_type != type) {
+            fprintf(stderr, "%s is a directory\n", name);
+            return 0;
+        }
+    }
+
+    /* --- Its entry in the parent dir and the last entry, which moves into its slot. Both
+       have to be in the directory index, or the directory doesn't match it (corrupted). --- */
+    int dir_file_size = inode_size(fs, parent_dir_inode);
+    int last_offset = dir_file_size - DIR_ENTRY_SIZE;
+    DirIndex* index = get_dir_index(fs, parent_dir_inode);
+    DirSlot* entry = dir_index_lookup(index, name);
+    char last_entry[DIR_ENTRY_SIZE];
+    readFromFileAt(fs, last_entry, parent_dir_inode, DIR_ENTRY_SIZE, last_offset);
+    last_entry[DIR_ENTRY_SIZE - 1] = '\0';
+    if (entry == NULL || dir_index_lookup(index, last_entry + 4) == NULL) {
+        fprintf(stderr, "The entries of directory inode %d don't match what was read, run fsck\n", parent_dir_inode);
+        return 0;
+    }
+    int entry_offset = entry->offset;
+
+    /* --- Deallocate the corresponding data blocks (and indirect blocks) and its inode block --- */
+    truncate_blocks(fs, inode_id, file_size / bs + 1, 0);
+    free_inode(fs, inode_id);
+
+    /* --- Delete the corresponding entry in the parent dir --- */
+    dir_index_remove(index, name);
+    if (entry_offset != last_offset) {
+        writeToFileAt(fs, last_entry, parent_dir_inode, DIR_ENTRY_SIZE, entry_offset);
+        dir_index_lookup(index, last_entry + 4)->offset = entry_offset;
+    }
+
+    /* --- Shrink the parent dir, its last block goes away once it's empty --- */
+    if (last_offset / bs != dir_file_size / bs) {
+        truncate_blocks(fs, parent_dir_inode, dir_file_size / bs + 1, last_offset / bs + 1);
+    }
+    set_inode_size(fs, parent_dir_inode, last_offset);
+
+    cache_dentry(fs, name, parent_dir_inode, 0, -1);
+    if (type == 0) {
+        drop_dir_index(fs, inode_id);
+        invalidate_dentries(fs, inode_id);
+    }
+    return 1;
+}
+
+static int delete_file(LLFS* fs, char* name, int type, char* path)
+{
+    if (memcmp(name, "/", 2) == 0) {
+        fprintf(stderr, "%s\n", "Can't delete root directory");
+        return 0;
+    }
+
+    /* --- The parent dir and the file are locked, whoever else uses the file got it
+       through the parent and is done with it --- */
+    int reserved = 1, parent_dir_inode, inode_id;
+    while (1) {
+        begin_operation(fs, 0, delete_meta(fs, 1, reserved));
+        parent_dir_inode = ROOT_INODE;
+        inode_id = find_file_inode_with_parent(fs, name, path, &parent_dir_inode);
+        if (inode_id == 0 || file_blocks(fs, inode_id) <= reserved) break;
+
+        /* A file with more blocks than reserved for, begin again with room for them */
+        reserved = file_blocks(fs, inode_id);
+        unlock_inode(fs, inode_id);
+        unlock_inode(fs, parent_dir_inode);
+        end_operation(fs);
+    }
+    if (inode_id == 0) {
+        fprintf(stderr, "File %s doesn't exist in %s\n", name, path);
+        end_operation(fs);
+        return 0;
+    }
+    int removed = remove_inode(fs, name, type, inode_id, parent_dir_inode);
+    unlock_inode(fs, inode_id);
+    unlock_inode(fs, parent_dir_inode);
+    end_operation(fs);
+    return removed ? inode_id : 0;
+}
+
+int deleteFile(LLFS* fs, char* name, int type, char* path)
+{
+    long long span = TRACE_BEGIN();
+    int inode_id = delete_file(fs, name, type, path);
+    TRACE_END("deleteFile", span);
+    return inode_id;
+}
+
+static int names_per_operation(LLFS* fs, int (*meta)(LLFS*, int))
+{
+    /* A bulk operation is split so that what each part can change fits in an empty transaction */
+    int n = fs->journal_limit;
+    while (n > 1 && meta(fs, n) > fs->journal_limit) n--;
+    return n;
+}
+
+static int delete_meta_most(LLFS* fs, int n)
+{
+    /* delete_meta() whatever the size of the files */
+    return delete_meta(fs, n, fs->num_blocks);
+}
 
-short find_bit_one(int c)
+static int create_inodes(LLFS* fs, char** names, int count, int type, int directory_inode)
 {
-    /* Given a byte, find the first 1 bit starting from the left */
-    int mask = 0x100;
-    for (short i = 0; i < 8; i++) {
-        mask = mask >> 1;
-        if ((mask & c) == mask) return i;
+    /* The inodes and their data blocks are taken in one sweep each, and the entries are
+       appended to the directory with one write. All or nothing, returns how many. */
+    int* inode_ids = (int*) malloc(count * sizeof(int));
+    int* blocks = (int*) malloc(count * sizeof(int));
+    if (!allocate_inodes(fs, count, inode_ids)) {
+        fprintf(stderr, "%s\n", "No more inode blocks available");
+        free(inode_ids);
+        free(blocks);
+        return 0;
     }
-    return -1;
+    if (!allocate_blocks(fs, count, 0, blocks, 0)) {
+        fprintf(stderr, "%s\n", "No more data blocks available");
+        for (int i = 0; i < count; i++) free_inode(fs, inode_ids[i]);
+        free(inode_ids);
+        free(blocks);
+        return 0;
+    }
+
+    char* entries = (char*) calloc(count, DIR_ENTRY_SIZE);
+    for (int i = 0; i < count; i++) {
+        set_inode_type(fs, inode_ids[i], type);
+        set_inode_block(fs, inode_ids[i], 0, blocks[i]);
+        memcpy(entries + i * DIR_ENTRY_SIZE, &inode_ids[i], 4);
+        memcpy(entries + i * DIR_ENTRY_SIZE + 4, names[i], strlen(names[i]) + 1);
+    }
+    int offset = get_file_size(fs, directory_inode);
+    int created = count;
+    if (writeToFile(fs, entries, directory_inode, count * DIR_ENTRY_SIZE) == 0) {
+        for (int i = 0; i < count; i++) {
+            free_inode(fs, inode_ids[i]);
+            deallocate_block(fs, blocks[i]);
+        }
+        created = 0;
+    }
+
+    DirIndex* index = get_dir_index(fs, directory_inode);
+    for (int i = 0; i < created; i++) {
+        dir_index_insert(index, names[i], inode_ids[i], offset + i * DIR_ENTRY_SIZE);
+        cache_dentry(fs, names[i], directory_inode, inode_ids[i], type);
+    }
+    free(entries);
+    free(inode_ids);
+    free(blocks);
+    return created;
 }
 
-short find_available_block(FILE* disk, int data_type)
+int createFiles(LLFS* fs, char** names, int count, int type, char* path)
 {
-    int c, lower_bound, upper_bound;
-    short bit_one_num;
-    char* buffer = (char*) malloc(BLOCK_SIZE);
-    readBlock(disk, 1, buffer);
+    /* Like createFile for every name, but the parent dir is resolved and locked once
+       per operation, and the names are checked against it (and each other) in one pass.
+       Returns how many were created. */
+    long long span = TRACE_BEGIN();
+    int created = 0;
+    int group = names_per_operation(fs, create_meta);
+    char** valid = (char**) malloc((count < group ? count : group) * sizeof(char*));
+    for (int first = 0; first < count; first += group) {
+        int n = (count - first < group) ? count - first : group;
+        begin_operation(fs, n + 4, create_meta(fs, n));
+        int directory_inode = walk_path(fs, path, 1);
+        if (directory_inode == 0) {
+            end_operation(fs);
+            break;
+        }
 
-    // 0 for metadata, 1 for filedata
-    if (data_type == 0) {
-        // first 16 bytes (128 bits) are for metadata blocks
-        lower_bound = 0;
-        upper_bound = 16;
-    } else {
-        lower_bound = 16;
-        upper_bound = BLOCK_SIZE;
+        DirIndex batch = { 0, 0, NULL }; // the names of this batch, to catch duplicates
+        int num_valid = 0;
+        for (int i = first; i < first + n; i++) {
+            if (strlen(names[i]) > MAX_NAME_LENGTH) {
+                fprintf(stderr, "The name %s is longer than %d characters\n", names[i], MAX_NAME_LENGTH);
+            } else if (dir_index_lookup(&batch, names[i]) != NULL) {
+                fprintf(stderr, "There's a name collision with %s\n", names[i]);
+            } else if (!name_collision(fs, directory_inode, names[i])) {
+                dir_index_insert(&batch, names[i], 1, 0);
+                valid[num_valid++] = names[i];
+            }
+        }
+        free(batch.slots);
+
+        if (num_valid > 0) created += create_inodes(fs, valid, num_valid, type, directory_inode);
+        unlock_inode(fs, directory_inode);
+        end_operation(fs);
     }
+    free(valid);
+    TRACE_END("createFiles", span);
+    return created;
+}
 
-    for (int i = lower_bound; i < upper_bound; i++) {
-        c = buffer[i];
-        if ((bit_one_num = find_bit_one(c)) != -1) {
-            buffer[i] = c & (~(0x80 >> bit_one_num)); // set to 0 now
-            writeBlock(disk, 1, buffer);
-            free(buffer);
-            return i * 8 + bit_one_num;
+int deleteFiles(LLFS* fs, char** names, int count, int type, char* path)
+{
+    /* Like deleteFile for every name, but the parent dir is resolved and locked once
+       per operation. Each entry is filled by the last one of the directory, whose blocks
+       stay in the block cache until the commit. Returns how many were removed. */
+    long long span = TRACE_BEGIN();
+    int removed = 0;
+    int group = names_per_operation(fs, delete_meta_most);
+    for (int first = 0; first < count; first += group) {
+        int n = (count - first < group) ? count - first : group;
+
+        /* --- Room for the blocks of every file is reserved once they're counted, with the
+           directory locked (nothing can reach them anymore). If there are more than the
+           operation began with, it begins again with room for them. --- */
+        int reserved = n, directory_inode;
+        while (1) {
+            begin_operation(fs, 0, delete_meta(fs, n, reserved));
+            directory_inode = walk_path(fs, path, 1);
+            if (directory_inode == 0) break;
+            int blocks = 0;
+            for (int i = first; i < first + n; i++) {
+                int file_type;
+                int inode_id = lookup_dentry(fs, names[i], directory_inode, &file_type);
+                if (inode_id == 0) continue;
+                lock_inode(fs, inode_id, 0);
+                blocks += file_blocks(fs, inode_id);
+                unlock_inode(fs, inode_id);
+            }
+            if (blocks <= reserved) break;
+            unlock_inode(fs, directory_inode);
+            end_operation(fs);
+            reserved = blocks;
+        }
+        if (directory_inode == 0) {
+            end_operation(fs);
+            break;
         }
+
+        for (int i = first; i < first + n; i++) {
+            int file_type;
+            int inode_id = lookup_dentry(fs, names[i], directory_inode, &file_type);
+            if (inode_id == 0) {
+                fprintf(stderr, "File %s doesn't exist in %s\n", names[i], path);
+                continue;
+            }
+            lock_inode(fs, inode_id, 1);
+            removed += remove_inode(fs, names[i], type, inode_id, directory_inode);
+            unlock_inode(fs, inode_id);
+        }
+        unlock_inode(fs, directory_inode);
+        end_operation(fs);
+    }
+    TRACE_END("deleteFiles", span);
+    return removed;
+}
+
+static int write_chunk(LLFS* fs)
+{
+    /* The most bytes one operation writes, a whole number of indirect blocks' worth
+       whose write_meta() fits in an empty transaction */
+    long long chunk = 0;
+    for (int k = fs->journal_limit; k >= 1; k--) {
+        chunk = (long long) k * fs->ptrs_per_block * fs->block_size;
+        if (chunk > INT_MAX) chunk = INT_MAX;
+        if (write_meta(fs, (int) chunk) <= fs->journal_limit) break;
     }
+    return (int) chunk;
+}
 
-    free(buffer);
-    return 0; // means no available blocks
+int LLFS_Read(LLFS* fs, char* name, char* buffer, int size, char* path)
+{
+    int outer = stats_enter(OP_READ);
+    long long span = TRACE_BEGIN();
+    int inode_id = find_file_inode(fs, name, path, 0);
+    if (inode_id == 0) fprintf(stderr, "File %s doesn't exist in %s\n", name, path);
+    else {
+        readFromFile(fs, buffer, inode_id, size);
+        unlock_inode(fs, inode_id);
+    }
+    TRACE_END("LLFS_Read", span);
+    stats_leave(outer);
+    return inode_id;
+}
+
+int LLFS_Write(LLFS* fs, char* name, char* data, int size, char* path)
+{
+    /* A big write is done as several operations, each one is committed as a whole */
+    if (size < 0) {
+        fprintf(stderr, "Can't write %d bytes\n", size);
+        return 0;
+    }
+    int outer = stats_enter(OP_WRITE);
+    long long span = TRACE_BEGIN();
+    int chunk = write_chunk(fs);
+    int inode_id, done = 0;
+    do {
+        int n = (size - done < chunk) ? size - done : chunk;
+        begin_operation(fs, n / fs->block_size + 4, write_meta(fs, n));
+        inode_id = find_file_inode(fs, name, path, 1);
+        if (inode_id == 0) {
+            fprintf(stderr, "File %s doesn't exist in %s\n", name, path);
+            end_operation(fs);
+            break;
+        }
+        int written = writeToFile(fs, data + done, inode_id, n);
+        unlock_inode(fs, inode_id);
+        end_operation(fs);
+        if (written == 0 && n > 0) {
+            inode_id = 0; // the chunks before it stay written
+            break;
+        }
+        done += n;
+    } while (done < size);
+    TRACE_END("LLFS_Write", span);
+    stats_leave(outer);
+    return inode_id;
 }
 
-void deallocate_block(FILE* disk, short blockNum)
+int LLFS_ReadStream(LLFS* fs, char* name, char* path, LLFSReadCallback callback, void* arg)
 {
-    int byte_num = blockNum / 8;
-    int bit_num = blockNum % 8;
-    char* buffer = (char*) malloc(BLOCK_SIZE);
-    readBlock(disk, 1, buffer);
-    buffer[byte_num] = (buffer[byte_num]) | (0x80 >> bit_num);
-    writeBlock(disk, 1, buffer);
+    /* Hands the file to callback STREAM_BUFFER bytes at a time (a whole number of blocks),
+       with the path walked once and the file locked shared until the end. callback
+       returns 0 to stop early. */
+    int outer = stats_enter(OP_READ_STREAM);
+    int inode_id = find_file_inode(fs, name, path, 0);
+    if (inode_id == 0) {
+        fprintf(stderr, "File %s doesn't exist in %s\n", name, path);
+        stats_leave(outer);
+        return 0;
+    }
+    int file_size = inode_size(fs, inode_id);
+    int chunk = (file_size < STREAM_BUFFER) ? file_size : STREAM_BUFFER;
+    char* buffer = (char*) malloc(chunk > 0 ? chunk : 1);
+    int ok = 1;
+    for (int offset = 0; offset < file_size && ok; offset += chunk) {
+        int length = readFromFileAt(fs, buffer, inode_id, chunk, offset);
+        ok = callback(arg, buffer, length);
+    }
     free(buffer);
+    unlock_inode(fs, inode_id);
+    stats_leave(outer);
+    return inode_id;
 }
 
-int writeToFile(FILE* disk, char* data, short inode_id, int size)
+int LLFS_ReadAt(LLFS* fs, char* name, char* buffer, int size, int offset, char* path)
 {
-    char* buffer = (char*) malloc(BLOCK_SIZE);
-    char* inodeBuffer = (char*) malloc(BLOCK_SIZE);
-    readBlock(disk, inode_id, inodeBuffer);
+    int outer = stats_enter(OP_READ_AT);
+    long long span = TRACE_BEGIN();
+    int inode_id = find_file_inode(fs, name, path, 0);
+    int read = 0;
+    if (inode_id == 0) fprintf(stderr, "File %s doesn't exist in %s\n", name, path);
+    else {
+        read = readFromFileAt(fs, buffer, inode_id, size, offset);
+        unlock_inode(fs, inode_id);
+    }
+    TRACE_END("LLFS_ReadAt", span);
+    stats_leave(outer);
+    return read;
+}
 
-    /* --- Find where to begin to write --- */
-    int current_file_size;
-    memcpy(&current_file_size, inodeBuffer, 4);
-    int dataBlockOffset = (int) (current_file_size / BLOCK_SIZE);
-    short fileBlockNumber;
-    memcpy(&fileBlockNumber, (inodeBuffer + 8) + 2 * dataBlockOffset, 2);
-
-    /* Make sure it doesn't exceed the max file size */
-    if ((current_file_size + size) > 129024) {
-        fprintf(stderr, "%s\n", "Exceeded the max file size (129024)");
+int LLFS_WriteAt(LLFS* fs, char* name, char* data, int size, int offset, char* path)
+{
+    if (size < 0) {
+        fprintf(stderr, "Can't write %d bytes at offset %d\n", size, offset);
         return 0;
     }
+    int outer = stats_enter(OP_WRITE_AT);
+    long long span = TRACE_BEGIN();
+    int chunk = write_chunk(fs);
+    int done = 0, result = size;
+    do {
+        int n = (size - done < chunk) ? size - done : chunk;
+        begin_operation(fs, n / fs->block_size + 4, write_meta(fs, n));
+        int inode_id = find_file_inode(fs, name, path, 1);
+        if (inode_id == 0) {
+            fprintf(stderr, "File %s doesn't exist in %s\n", name, path);
+            end_operation(fs);
+            result = 0;
+            break;
+        }
+        int written = writeToFileAt(fs, data + done, inode_id, n, offset + done);
+        unlock_inode(fs, inode_id);
+        end_operation(fs);
+        if (written == 0) {
+            result = 0;
+            break;
+        }
+        done += n;
+    } while (done < size);
+    TRACE_END("LLFS_WriteAt", span);
+    stats_leave(outer);
+    return result;
+}
 
-    /* Some useful numbers */
-    int last_block_bytes_left = BLOCK_SIZE - (current_file_size % BLOCK_SIZE);
-    int remaining_size = size - last_block_bytes_left;
-
-    /* --- Write file data to last block --- */
-    readBlock(disk, fileBlockNumber, buffer);
-    if (remaining_size < 0) memcpy(buffer + (current_file_size % BLOCK_SIZE), data, size);
-    else                    memcpy(buffer + (current_file_size % BLOCK_SIZE), data, last_block_bytes_left);
-    writeBlock(disk, fileBlockNumber, buffer);
+/* --- Streaming appends --- */
 
-    /* --- Write file data to new blocks --- */
-    if (remaining_size >= 0) {
-        data += last_block_bytes_left; // remaining data
-        int num_new_blocks = ((int) (remaining_size / BLOCK_SIZE)) + 1;
+LLFSWriter* LLFS_OpenWriter(LLFS* fs, char* name, char* path)
+{
+    /* Appends to the file as the data arrives, whole blocks at a time, with one
+       block of memory whatever the size of the data */
+    int outer = stats_enter(OP_APPEND);
+    int inode_id = find_file_inode(fs, name, path, 0);
+    stats_leave(outer);
+    if (inode_id == 0) {
+        fprintf(stderr, "File %s doesn't exist in %s\n", name, path);
+        return NULL;
+    }
+    LLFSWriter* writer = (LLFSWriter*) calloc(1, sizeof(LLFSWriter));
+    writer->fs = fs;
+    writer->size = inode_size(fs, inode_id);
+    unlock_inode(fs, inode_id);
+    memcpy(writer->name, name, strlen(name) + 1);
+    writer->path = (char*) malloc(strlen(path) + 1);
+    memcpy(writer->path, path, strlen(path) + 1);
+    writer->buffer = (char*) malloc(fs->block_size);
+    return writer;
+}
 
-        for(int i = 1; i <= num_new_blocks; i++) {
+static void flush_writer(LLFSWriter* writer, char* data, int size)
+{
+    int outer = stats_enter(OP_APPEND);
+    if (LLFS_Write(writer->fs, writer->name, data, size, writer->path) == 0) writer->failed = 1;
+    else writer->size += size;
+    stats_leave(outer);
+}
 
-            short newDataBlock = find_available_block(disk, 1);
-            if (newDataBlock == 0) {
-                fprintf(stderr, "%s\n", "No more data blocks available");
-                return 0;
-            }
-            memcpy((inodeBuffer + 8) + 2 * (dataBlockOffset + i), &newDataBlock, 2);
-
-            if (remaining_size > 0) {
-                if (i != num_new_blocks) {
-                    memcpy(buffer, data, BLOCK_SIZE);
-                    writeBlock(disk, newDataBlock, buffer);
-                    data += BLOCK_SIZE;
-                    remaining_size -= BLOCK_SIZE;
-                } else {
-                    memcpy(buffer, data, remaining_size);
-                    writeBlock(disk, newDataBlock, buffer);
-                }
+int LLFS_WriterAppend(LLFSWriter* writer, char* data, int size)
+{
+    /* Whatever reaches a block boundary is written straight from data, the rest
+       waits in the buffer for the next call. Returns 0 once a write has failed. */
+    if (size < 0) {
+        fprintf(stderr, "Can't write %d bytes\n", size);
+        return 0;
+    }
+    int bs = writer->fs->block_size;
+    while (size > 0 && !writer->failed) {
+        int room = bs - (int) ((writer->size + writer->buffered) % bs); // to the end of the file's last block
+        int n;
+        if (writer->buffered == 0 && size >= room) {
+            n = room + (size - room) / bs * bs;
+            flush_writer(writer, data, n);
+        } else {
+            n = (size < room) ? size : room;
+            memcpy(writer->buffer + writer->buffered, data, n);
+            writer->buffered += n;
+            if (n == room) {
+                flush_writer(writer, writer->buffer, writer->buffered);
+                writer->buffered = 0;
             }
-
         }
+        data += n;
+        size -= n;
     }
+    return !writer->failed;
+}
 
-    /* --- Update file size and block status --- */
-    current_file_size += size;
-    memcpy(inodeBuffer, &current_file_size, 4);
-    writeBlock(disk, inode_id, inodeBuffer);
-
-    free(inodeBuffer);
-    free(buffer);
-    return size;
+int LLFS_CloseWriter(LLFSWriter* writer)
+{
+    if (writer->buffered > 0 && !writer->failed) flush_writer(writer, writer->buffer, writer->buffered);
+    int ok = !writer->failed;
+    free(writer->buffer);
+    free(writer->path);
+    free(writer);
+    return ok;
 }
 
-int readFromFile(FILE* disk, char* data, short inode_id, int size)
-{
-    char* buffer = (char*) malloc(BLOCK_SIZE);
-    char* inodeBuffer = (char*) malloc(BLOCK_SIZE);
-    readBlock(disk, inode_id, inodeBuffer);
-
-    /* --- Find where to stop reading --- */
-    int current_file_size;
-    memcpy(&current_file_size, inodeBuffer, 4);
-    if (current_file_size < size) size = current_file_size;
-    int lastDataBlock = (int) (size / BLOCK_SIZE);
-
-    /* Read file data from blocks */
-    short fileBlockNumber;
-    for(int i = 0; i <= lastDataBlock; i++) {
-
-        memcpy(&fileBlockNumber, (inodeBuffer + 8) + 2 * i, 2);
-        if (size > 0) {
-            if (i != lastDataBlock) {
-                readBlock(disk, fileBlockNumber, buffer);
-                memcpy(data, buffer, BLOCK_SIZE);
-                data += BLOCK_SIZE;
-                size -= BLOCK_SIZE;
-            } else {
-                readBlock(disk, fileBlockNumber, buffer);
-                memcpy(data, buffer, size);
+/* Read-ahead from the host file: one thread fills a buffer while the other one is appended */
+typedef struct ReadAhead ReadAhead;
+struct ReadAhead {
+    int             fd;
+    char*           buffers[2];
+    int             lengths[2]; // -1 for a read error, 0 at the end of the file
+    int             full[2];
+    int             stop;
+    pthread_mutex_t lock;
+    pthread_cond_t  changed;
+};
+
+static void* read_ahead(void* arg)
+{
+    ReadAhead* ra = (ReadAhead*) arg;
+    for (int i = 0; ; i ^= 1) {
+        pthread_mutex_lock(&ra->lock);
+        while (ra->full[i] && !ra->stop) pthread_cond_wait(&ra->changed, &ra->lock);
+        int stop = ra->stop;
+        pthread_mutex_unlock(&ra->lock);
+        if (stop) return NULL;
+
+        int length = 0;
+        while (length < STREAM_BUFFER) {
+            ssize_t n = read(ra->fd, ra->buffers[i] + length, STREAM_BUFFER - length);
+            if (n <= 0) {
+                if (n < 0) length = -1;
+                break;
             }
+            length += n;
         }
 
+        pthread_mutex_lock(&ra->lock);
+        ra->lengths[i] = length;
+        ra->full[i] = 1;
+        pthread_cond_broadcast(&ra->changed);
+        pthread_mutex_unlock(&ra->lock);
+        if (length < STREAM_BUFFER) return NULL; // the end of the file or an error
     }
-
-    free(inodeBuffer);
-    free(buffer);
-    return size;
 }
 
-int get_file_size(FILE* disk, short inode_id)
+int LLFS_AppendFromFd(LLFS* fs, char* name, char* path, int fd)
 {
-    char* inodeBuffer = (char*) malloc(BLOCK_SIZE);
-    readBlock(disk, inode_id, inodeBuffer);
+    /* Appends everything that can be read from fd to the file, reading the next
+       STREAM_BUFFER bytes from fd while the previous ones are written */
+    int outer = stats_enter(OP_APPEND);
+    LLFSWriter* writer = LLFS_OpenWriter(fs, name, path);
+    if (writer == NULL) {
+        stats_leave(outer);
+        return 0;
+    }
+    ReadAhead ra = { fd, { NULL, NULL }, { 0, 0 }, { 0, 0 }, 0 };
+    ra.buffers[0] = (char*) malloc(STREAM_BUFFER);
+    ra.buffers[1] = (char*) malloc(STREAM_BUFFER);
+    pthread_mutex_init(&ra.lock, NULL);
+    pthread_cond_init(&ra.changed, NULL);
+    pthread_t thread;
+    pthread_create(&thread, NULL, read_ahead, &ra);
+
+    int ok = 1;
+    for (int i = 0; ; i ^= 1) {
+        pthread_mutex_lock(&ra.lock);
+        while (!ra.full[i]) pthread_cond_wait(&ra.changed, &ra.lock);
+        int length = ra.lengths[i];
+        pthread_mutex_unlock(&ra.lock);
+        if (length < 0) {
+            fprintf(stderr, "%s\n", "Can't read the source file");
+            ok = 0;
+        }
+        if (length > 0 && !LLFS_WriterAppend(writer, ra.buffers[i], length)) ok = 0;
+        if (!ok || length < STREAM_BUFFER) break;
 
-    int current_file_size;
-    memcpy(&current_file_size, inodeBuffer, 4);
+        pthread_mutex_lock(&ra.lock);
+        ra.full[i] = 0;
+        pthread_cond_broadcast(&ra.changed);
+        pthread_mutex_unlock(&ra.lock);
+    }
 
-    free(inodeBuffer);
-    return current_file_size;
+    pthread_mutex_lock(&ra.lock);
+    ra.stop = 1;
+    pthread_cond_broadcast(&ra.changed);
+    pthread_mutex_unlock(&ra.lock);
+    pthread_join(thread, NULL);
+    pthread_mutex_destroy(&ra.lock);
+    pthread_cond_destroy(&ra.changed);
+    free(ra.buffers[0]);
+    free(ra.buffers[1]);
+    ok = LLFS_CloseWriter(writer) && ok;
+    stats_leave(outer);
+    return ok;
 }
 
-short find_inode(FILE* disk, char* name, short directory_inode)
+int LLFS_Rmdir(LLFS* fs, char* name, char* path)
 {
-    /* Find the inode of a file in a given directory */
+    int outer = stats_enter(OP_RMDIR);
+    int rv = deleteFile(fs, name, 0, path);
+    stats_leave(outer);
+    return rv;
+}
 
-    int size = get_file_size(disk, directory_inode);
-    char* buffer = (char*) malloc(size);
-    readFromFile(disk, buffer, directory_inode, size);
+int LLFS_Rm(LLFS* fs, char* name, char* path)
+{
+    int outer = stats_enter(OP_RM);
+    int rv = deleteFile(fs, name, 1, path);
+    stats_leave(outer);
+    return rv;
+}
 
-    short inode_id = 0;
-    for(int i = 0; i < size; ) {
-        if (memcmp(buffer + 1, name, strlen(name) + 1) == 0) {
-            memcpy(&inode_id, buffer, 1);
-            break;
-        }
-        i += 32;
-        buffer += 32;
-    }
+int LLFS_Mkdir(LLFS* fs, char* name, char* path)
+{
+    int outer = stats_enter(OP_MKDIR);
+    int rv = createFile(fs, name, 0, path);
+    stats_leave(outer);
+    return rv;
+}
 
-    return inode_id;
+int LLFS_Touch(LLFS* fs, char* name, char* path)
+{
+    int outer = stats_enter(OP_TOUCH);
+    int rv = createFile(fs, name, 1, path);
+    stats_leave(outer);
+    return rv;
 }
 
-int is_flat_file(FILE* disk, short inode_id)
+int LLFS_TouchMany(LLFS* fs, char** names, int count, char* path)
 {
-    char* inodeBuffer = (char*) malloc(BLOCK_SIZE);
-    readBlock(disk, inode_id, inodeBuffer);
+    int outer = stats_enter(OP_TOUCH);
+    int rv = createFiles(fs, names, count, 1, path);
+    stats_leave(outer);
+    return rv;
+}
 
-    int file_type;
-    memcpy(&file_type, inodeBuffer + 4, 4);
+int LLFS_RmMany(LLFS* fs, char** names, int count, char* path)
+{
+    int outer = stats_enter(OP_RM);
+    int rv = deleteFiles(fs, names, count, 1, path);
+    stats_leave(outer);
+    return rv;
+}
 
-    free(inodeBuffer);
-    return file_type;
+/* --- Directory listing --- */
+
+LLFSDir* LLFS_OpenDir(LLFS* fs, char* path, int plus)
+{
+    /* A cursor over the entries of the directory at path. With plus, LLFS_ReadDir()
+       also fills in the type and size of every entry (from the resident inode table). */
+    int outer = stats_enter(OP_READDIR);
+    int directory_inode = walk_path(fs, path, 0);
+    stats_leave(outer);
+    if (directory_inode == 0) return NULL;
+    unlock_inode(fs, directory_inode);
+
+    LLFSDir* dir = (LLFSDir*) malloc(sizeof(LLFSDir));
+    dir->fs = fs;
+    dir->path = (char*) malloc(strlen(path) + 1);
+    memcpy(dir->path, path, strlen(path) + 1);
+    dir->plus = plus;
+    dir->offset = 0;
+    return dir;
 }
 
-short walk_path(FILE* disk, char* _path)
+int LLFS_ReadDir(LLFSDir* dir, LLFSDirEntry* entries, int max)
 {
-    char* path = (char*) malloc(strlen(_path) + 1);
-    memcpy(path, _path, strlen(_path) + 1);
+    /* The next max entries at most, returns how many (0 at the end). The directory is
+       only locked during the call, so entries created or removed between two calls may
+       be missed or seen twice (a removal moves the last entry into the hole). */
+    LLFS* fs = dir->fs;
+    int outer = stats_enter(OP_READDIR);
+    int directory_inode = walk_path(fs, dir->path, 0);
+    if (directory_inode == 0) {
+        stats_leave(outer);
+        return 0;
+    }
 
-    short directory_inode = ROOT_INODE; // start walking from root
-    char* token = strtok(path, "/");
-    while(token != NULL) {
-        directory_inode = find_inode(disk, token, directory_inode);
-        if (directory_inode == 0) {
-            fprintf(stderr, "Directory named %s doesn't exist in %s\n", token, path);
-            free(path);
-            return 0;
-        }
-        if (is_flat_file(disk, directory_inode)) {
-            fprintf(stderr, "%s is not a directory\n", token);
-            free(path);
-            return 0;
+    char* buffer = (char*) malloc((size_t) max * DIR_ENTRY_SIZE);
+    int count = readFromFileAt(fs, buffer, directory_inode, max * DIR_ENTRY_SIZE, dir->offset) / DIR_ENTRY_SIZE;
+    for (int i = 0; i < count; i++) {
+        char* entry = buffer + i * DIR_ENTRY_SIZE;
+        memcpy(&entries[i].inode_id, entry, 4);
+        memcpy(entries[i].name, entry + 4, MAX_NAME_LENGTH + 1);
+        entries[i].name[MAX_NAME_LENGTH] = '\0';
+        entries[i].type = -1;
+        entries[i].size = -1;
+        if (dir->plus) {
+            lock_inode(fs, entries[i].inode_id, 0);
+            entries[i].type = inode_type(fs, entries[i].inode_id);
+            entries[i].size = inode_size(fs, entries[i].inode_id);
+            unlock_inode(fs, entries[i].inode_id);
         }
-        token = strtok(NULL, "/");
     }
+    dir->offset += count * DIR_ENTRY_SIZE;
+    unlock_inode(fs, directory_inode);
+    free(buffer);
+    stats_leave(outer);
+    return count;
+}
 
-    free(path);
-    return directory_inode;
+void LLFS_CloseDir(LLFSDir* dir)
+{
+    free(dir->path);
+    free(dir);
 }
 
-short find_file_inode(FILE* disk, char* name, char* path)
+int LLFS_get_size(LLFS* fs, char* name, char* path)
 {
-    short directory_inode = walk_path(disk, path); // dir that contains the file
-    if (directory_inode == 0) return 0;
-    return find_inode(disk, name, directory_inode);
+    int outer = stats_enter(OP_GET_SIZE);
+    int inode_id = find_file_inode(fs, name, path, 0);
+    int file_size = 0;
+    if (inode_id == 0) fprintf(stderr, "File %s doesn't exist in %s\n", name, path);
+    else {
+        file_size = get_file_size(fs, inode_id);
+        unlock_inode(fs, inode_id);
+    }
+    stats_leave(outer);
+    return file_size;
 }
 
-short find_file_inode_with_parent(FILE* disk, char* name, char* path, short* parent_dir_inode)
+static int valid_block_size(int block_size)
 {
-    short directory_inode = walk_path(disk, path); // dir that contains the file
-    if (directory_inode == 0) return 0;
-    *parent_dir_inode = directory_inode;
-    return find_inode(disk, name, directory_inode);
+    return block_size >= MIN_BLOCK_SIZE && block_size <= MAX_BLOCK_SIZE && (block_size & (block_size - 1)) == 0;
 }
 
-int name_collision(FILE* disk, short directory_inode, char* name)
+static void init_locks(LLFS* fs)
 {
-    if (find_inode(disk, name, directory_inode) == 0) {
-        return 0;
-    } else {
-        fprintf(stderr, "There's a name collision with %s\n", name);
-        return 1;
-    }
+    LLFSLocks* locks = (LLFSLocks*) malloc(sizeof(LLFSLocks));
+    pthread_rwlock_init(&locks->journal, NULL);
+    pthread_mutex_init(&locks->alloc, NULL);
+    pthread_mutex_init(&locks->txn, NULL);
+    pthread_mutex_init(&locks->index, NULL);
+    for (int i = 0; i < DCACHE_LOCKS; i++) pthread_mutex_init(&locks->dcache[i], NULL);
+    locks->inodes = (pthread_rwlock_t*) malloc(fs->num_inodes * sizeof(pthread_rwlock_t));
+    for (int i = 0; i < fs->num_inodes; i++) pthread_rwlock_init(&locks->inodes[i], NULL);
+    fs->locks = locks;
 }
 
-void file_system_check(FILE* disk)
+static void free_locks(LLFS* fs)
 {
-    char* transBuffer = (char*) malloc(BLOCK_SIZE);
-    char transaction;
-    char end_transaction = 't';
-    short inode_id;
-    short dataBlock;
-    short blockNum = 0;
-    readBlock(disk, 0, transBuffer);
-    memcpy(&transaction, transBuffer + 12, 1);
-    memcpy(&inode_id, transBuffer + 13, 2);
-    memcpy(&dataBlock, transBuffer + 15, 2);
+    LLFSLocks* locks = fs->locks;
+    if (locks == NULL) return;
+    pthread_rwlock_destroy(&locks->journal);
+    pthread_mutex_destroy(&locks->alloc);
+    pthread_mutex_destroy(&locks->txn);
+    pthread_mutex_destroy(&locks->index);
+    for (int i = 0; i < DCACHE_LOCKS; i++) pthread_mutex_destroy(&locks->dcache[i]);
+    for (int i = 0; i < fs->num_inodes; i++) pthread_rwlock_destroy(&locks->inodes[i]);
+    free(locks->inodes);
+    free(locks);
+}
 
-    /* If the file system is corrupted, it's going to repair it */
-    if ((memcmp(&transaction, &end_transaction, 2) != 0)) {
-        if ((memcmp(&inode_id, &blockNum, 2) != 0)) deallocate_block(disk, inode_id);
-        if ((memcmp(&dataBlock, &blockNum, 2) != 0)) deallocate_block(disk, dataBlock);
+static void free_llfs(LLFS* fs)
+{
+    if (fs->dir_index != NULL) {
+        for (int i = 0; i < ROOT_INODE + fs->num_inodes; i++) drop_dir_index(fs, i);
     }
+    free(fs->superblock);
+    free(fs->bitmap);
+    free(fs->bitmap_dirty);
+    free(fs->inodes);
+    free(fs->inode_dirty);
+    free(fs->inode_map);
+    free(fs->txn);
+    free(fs->pending_free);
+    free(fs->dir_index);
+    free_locks(fs);
+    free(fs);
 }
 
-short createFile(FILE* disk, char* name, int type, char* path)
+LLFS* MountLLFS(char* path)
 {
-    /* --- Start transaction --- */
-    char* transBuffer = (char*) malloc(BLOCK_SIZE);
-    readBlock(disk, 0, transBuffer);
-    char transaction = 'T';
-    memcpy(transBuffer + 12, &transaction, 1);
-    writeBlock(disk, 0, transBuffer);
+    return MountLLFSWith(path, DEFAULT_BACKEND);
+}
 
-    /* --- Allocate blocks --- */
-    short inode_id = find_available_block(disk, 0);
-    if (inode_id == 0) {
-        fprintf(stderr, "%s\n", "No more inode blocks available");
-        return 0;
+static LLFS* mount_llfs(char* path, int backend)
+{
+    /* --- The geometry is at the start of the superblock, whatever the block size --- */
+    Disk* disk = openDisk(path, MIN_BLOCK_SIZE, 0);
+    if (disk == NULL) {
+        fprintf(stderr, "Can't open the disk %s\n", path);
+        return NULL;
+    }
+    char header[MIN_BLOCK_SIZE];
+    readBlock(disk, 0, header);
+    closeDisk(disk);
+
+    int magic_num, version, block_size, inode_size;
+    memcpy(&magic_num, header + SB_MAGIC, 4);
+    memcpy(&version, header + SB_VERSION, 4);
+    memcpy(&block_size, header + SB_BLOCK_SIZE, 4);
+    memcpy(&inode_size, header + SB_INODE_SIZE, 4);
+    if (magic_num != LLFS_MAGIC || version != LLFS_VERSION || !valid_block_size(block_size) || inode_size != INODE_SIZE) {
+        fprintf(stderr, "%s is not an LLFS disk (or was formatted by another version)\n", path);
+        return NULL;
     }
-    memcpy(transBuffer + 13, &inode_id, 2); // for filesystem recovery
-    writeBlock(disk, 0, transBuffer);       // for filesystem recovery
 
-    short dataBlock1 = find_available_block(disk, 1);
-    if (dataBlock1 == 0) {
-        fprintf(stderr, "%s\n", "No more data blocks available");
-        deallocate_block(disk, inode_id);
-        return 0;
+    disk = (backend == DISK_MMAP) ? mapDisk(path, block_size, DEFAULT_CACHE_BLOCKS) : openDisk(path, block_size, DEFAULT_CACHE_BLOCKS);
+    if (disk == NULL) {
+        fprintf(stderr, "Can't open the disk %s\n", path);
+        return NULL;
     }
-    memcpy(transBuffer + 15, &dataBlock1, 2); // for filesystem recovery
-    writeBlock(disk, 0, transBuffer);         // for filesystem recovery
 
-    /* --- Insert default inode data --- */
-    char* inode = (char*) malloc(BLOCK_SIZE);
-    int file_size = 0;
-    int file_type = type; // 0 for directory, 1 for flat file
-    memcpy(inode + 0, &file_size, 4);
-    memcpy(inode + 4, &file_type, 4);
-    memcpy(inode + 8, &dataBlock1, 2);
-    writeBlock(disk, inode_id, inode);
-    free(inode);
+    LLFS* fs = (LLFS*) calloc(1, sizeof(LLFS));
+    fs->disk = disk;
+    fs->block_size = block_size;
+    fs->superblock = (char*) malloc(block_size);
+    readBlock(fs->disk, 0, fs->superblock);
+    memcpy(&fs->num_blocks, fs->superblock + SB_NUM_BLOCKS, 4);
+    memcpy(&fs->num_inodes, fs->superblock + SB_NUM_INODES, 4);
+    memcpy(&fs->bitmap_blocks, fs->superblock + SB_BITMAP_BLOCKS, 4);
+    memcpy(&fs->inode_start, fs->superblock + SB_INODE_START, 4);
+    memcpy(&fs->data_start, fs->superblock + SB_DATA_START, 4);
+    memcpy(&fs->journal_start, fs->superblock + SB_JOURNAL_START, 4);
+    memcpy(&fs->journal_blocks, fs->superblock + SB_JOURNAL_BLOCKS, 4);
+
+    fs->inodes_per_block = block_size / INODE_SIZE;
+    fs->inode_blocks = fs->journal_start - fs->inode_start;
+
+    /* --- A transaction has to fit in the journal with its descriptors and commit block,
+       and in half of the block cache --- */
+    fs->journal_limit = fs->journal_blocks - 3;
+    while (fs->journal_limit > 1 && journal_span(fs, fs->journal_limit) > fs->journal_blocks - 1) fs->journal_limit--;
+    if (disk->cache_size > 0 && fs->journal_limit > disk->cache_size / 2) fs->journal_limit = disk->cache_size / 2;
+    if (fs->journal_limit < 1) fs->journal_limit = 1;
+    fs->max_txn = fs->journal_limit;
+    fs->txn = (JournalBlock*) malloc(fs->max_txn * sizeof(JournalBlock));
+    init_locks(fs);
+
+    /* --- Redo the committed transactions before reading the metadata --- */
+    if (!file_system_check(fs)) {
+        closeDisk(disk);
+        free_llfs(fs);
+        return NULL;
+    }
 
-    /* --- Create a dir entry in the given dir --- */
-    if ((memcmp(name, "/", 2) != 0)) { // root dir doesn't need the code below
-        short directory_inode = walk_path(disk, path);
-        if (directory_inode == 0 || name_collision(disk, directory_inode, name)) {
-            deallocate_block(disk, inode_id);
-            deallocate_block(disk, dataBlock1);
-            return 0;
-        }
-        char* dir_entry = (char*) calloc(32, 1);
-        memcpy(dir_entry, &inode_id, 1);
-        memcpy(dir_entry + 1, name, strlen(name) + 1);
-        writeToFile(disk, dir_entry, directory_inode, 32); // create a dir entry in root. 
-        free(dir_entry);
+    /* --- Inode: size, type, in-use flag, direct pointers, then a single and a double indirect pointer --- */
+    fs->direct_ptrs = (INODE_SIZE - 12) / 4 - 2;
+    fs->ptrs_per_block = block_size / 4;
+    long long max_blocks = fs->direct_ptrs + fs->ptrs_per_block + (long long) fs->ptrs_per_block * fs->ptrs_per_block;
+    fs->max_file_size = (max_blocks * block_size - 1 > INT_MAX) ? INT_MAX : (int) (max_blocks * block_size - 1);
+
+    fs->bitmap = (char*) malloc((size_t) fs->bitmap_blocks * block_size);
+    fs->bitmap_dirty = (char*) calloc(fs->bitmap_blocks, 1);
+    readBlocks(fs->disk, 1, fs->bitmap, fs->bitmap_blocks * block_size);
+    fs->inodes = (char*) malloc((size_t) fs->inode_blocks * block_size);
+    fs->inode_dirty = (char*) calloc(fs->inode_blocks, 1);
+    fs->dir_index = (DirIndex**) calloc(ROOT_INODE + fs->num_inodes, sizeof(DirIndex*));
+    readBlocks(fs->disk, fs->inode_start, fs->inodes, fs->inode_blocks * block_size);
+
+    /* --- The inode map (1 for a free inode) is rebuilt from the in-use flags --- */
+    fs->inode_map = (char*) calloc((fs->num_inodes + 63) / 64, 8);
+    for (int i = 0; i < fs->num_inodes; i++) {
+        int in_use;
+        memcpy(&in_use, inode_ptr(fs, ROOT_INODE + i) + 8, 4);
+        if (!in_use) fs->inode_map[i / 8] |= 0x80 >> (i % 8);
     }
 
-    /* --- End transaction --- */
-    transaction = 't';
-    short blockNum = 0;
-    memcpy(transBuffer + 12, &transaction, 1);
-    memcpy(transBuffer + 13, &blockNum, 2);
-    memcpy(transBuffer + 15, &blockNum, 2);
-    writeBlock(disk, 0, transBuffer);
+    fs->next_fit[0] = 0; // inode map bit
+    fs->next_fit[1] = fs->data_start;
+    fs->free_blocks = count_free_blocks(fs);
 
-    free(transBuffer);
-    return inode_id;
+    /* --- Not unmounted cleanly: check what changed since the last clean unmount --- */
+    memcpy(&fs->dirty_regions, fs->superblock + SB_DIRTY_REGIONS, 8);
+    if (fs->dirty_regions != 0) check_dirty_regions(fs);
+
+    return fs;
 }
 
-short deleteFile(FILE* disk, char* name, int type, char* path)
+LLFS* MountLLFSWith(char* path, int backend)
 {
-    if (memcmp(name, "/", 2) == 0) {
-        fprintf(stderr, "%s\n", "Can't delete root directory");
-        return 0;
-    }
+    int outer = stats_enter(OP_MOUNT);
+    LLFS* fs = mount_llfs(path, backend);
+    stats_leave(outer);
+    return fs;
+}
 
-    short parent_dir_inode = ROOT_INODE;
-    short inode_id = find_file_inode_with_parent(disk, name, path, &parent_dir_inode);
-    if (inode_id == 0) {
-        fprintf(stderr, "File %s doesn't exist in %s\n", name, path);
-        return 0;
-    }
+void UnmountLLFS(LLFS* fs)
+{
+    if (fs == NULL) return;
+    int outer = stats_enter(OP_MOUNT);
+    LLFS_Sync(fs); // a clean journal, nothing to replay at the next mount
+    if (fs->dirty_regions != 0) mark_dirty_regions(fs, 0); // and nothing to check
+    closeDisk(fs->disk);
+    free_llfs(fs);
+    stats_leave(outer);
+}
 
-    char* inodeBuffer = (char*) malloc(BLOCK_SIZE);
-    int file_size;
-    int file_type;
-    short fileBlockNumber;
-    int lastDataBlock;
+void AbandonLLFS(LLFS* fs)
+{
+    /* Nothing more is written: what isn't committed is lost and the next mount replays the journal */
+    if (fs == NULL) return;
+    dropDisk(fs->disk);
+    free_llfs(fs);
+}
 
-    readBlock(disk, inode_id, inodeBuffer);
-    memcpy(&file_size, inodeBuffer, 4);
-    memcpy(&file_type, inodeBuffer + 4, 4);
+void LLFS_CrashAfter(LLFS* fs, int commits)
+{
+    /* For crash tests: the disk stops taking writes right after the commits-th journal write from now */
+    pthread_rwlock_wrlock(&fs->locks->journal);
+    fs->crash_after = commits;
+    pthread_rwlock_unlock(&fs->locks->journal);
+}
 
-    /* --- Check if it's a directory or a flat file --- */
-    if (type == 0) {
-        if (file_type != type) {
-            fprintf(stderr, "%s is not a directory\n", name);
-            free(inodeBuffer);
-            return 0;
-        }
-        if (file_size != 0) {
-            fprintf(stderr, "The directory %s contains files\n", name);
-            free(inodeBuffer);
-            return 0;
-        }
-    } else {
-        if (file_type != type) {
-            fprintf(stderr, "%s is a directory\n", name);
-            free(inodeBuffer);
-            return 0;
-        }
-    }
+void LLFS_Sync(LLFS* fs)
+{
+    int outer = stats_enter(OP_SYNC);
+    pthread_rwlock_wrlock(&fs->locks->journal);
+    commit_transaction(fs);
+    journal_checkpoint(fs);
+    pthread_rwlock_unlock(&fs->locks->journal);
+    stats_leave(outer);
+}
 
-    /* --- Deallocate the corresponding data blocks and its inode block --- */
-    lastDataBlock = (int) (file_size / BLOCK_SIZE);
-    for(int i = 0; i <= lastDataBlock; i++) {
-        memcpy(&fileBlockNumber, (inodeBuffer + 8) + 2 * i, 2);
-        deallocate_block(disk, fileBlockNumber);
-    }
-    deallocate_block(disk, inode_id);
+int LLFS_Fsck(LLFS* fs, int repair)
+{
+    /* The full check, with repair: bad directory entries are dropped, inodes in no directory
+       freed and the bitmap made to match the inodes. Bad block pointers and blocks used
+       twice are only reported. Returns how many problems were found. */
+    int outer = stats_enter(OP_FSCK);
+    long long span = TRACE_BEGIN();
+    Fsck check = { fs, repair, 0, NULL, NULL };
+    check.expected = (char*) malloc((size_t) fs->bitmap_blocks * fs->block_size);
+    check.reached = (char*) calloc(fs->num_inodes, 1);
+
+    /* --- No operation is halfway through and everything is committed --- */
+    pthread_rwlock_wrlock(&fs->locks->journal);
+    commit_transaction(fs);
+    check_tree(&check);
+    if (repair) commit_transaction(fs); // the blocks of rewritten directories are free now
+    check_inodes(&check);
+    compare_bitmaps(&check);
+    if (repair) commit_transaction(fs);
+    pthread_rwlock_unlock(&fs->locks->journal);
+
+    if (check.problems > FSCK_REPORTS) fprintf(stderr, "(%d more not shown)\n", check.problems - FSCK_REPORTS);
+    free(check.expected);
+    free(check.reached);
+    TRACE_END("fsck", span);
+    stats_leave(outer);
+    return check.problems;
+}
 
-    /* --- Delete the corresponding entry in the parent dir --- */
-    int dir_file_size;
-    readBlock(disk, parent_dir_inode, inodeBuffer);
-    memcpy(&dir_file_size, inodeBuffer, 4);
-
-    char* buffer = (char*) malloc(dir_file_size);
-    readFromFile(disk, buffer, parent_dir_inode, dir_file_size);
-    
-    char* temp = buffer;
-    for(int i = 0, offset = 0; i < dir_file_size; offset++) {
-        if (memcmp(temp + 1, name, strlen(name) + 1) == 0) {
-            if (i + 32 != dir_file_size) { // delete by shifting left
-                memcpy(temp, temp + 32, dir_file_size - 32 * (offset + 1));
-            }
-            break;
-        }
-        i += 32;
-        temp += 32;
+static int format_llfs(char* path, int block_size, int num_blocks, int num_inodes)
+{
+    /* --- Check the geometry --- */
+    if (!valid_block_size(block_size)) {
+        fprintf(stderr, "The block size must be a power of 2 from %d to %d\n", MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+        return 0;
     }
-
-    /* --- Rewrite entries in the parent dir --- */
-    lastDataBlock = (int) (dir_file_size / BLOCK_SIZE);
-    for(int i = 1; i <= lastDataBlock; i++) { // deallocate all blocks except the first one
-        memcpy(&fileBlockNumber, (inodeBuffer + 8) + 2 * i, 2);
-        deallocate_block(disk, fileBlockNumber);
+    if (num_inodes < 1 || (long long) num_inodes * INODE_SIZE > INT_MAX - block_size) {
+        fprintf(stderr, "Can't have %d inodes\n", num_inodes);
+        return 0;
+    }
+    int bitmap_blocks = (int) (((long long) num_blocks + 8LL * block_size - 1) / (8LL * block_size));
+    int inode_start = 1 + bitmap_blocks;
+    int inode_blocks = (num_inodes + block_size / INODE_SIZE - 1) / (block_size / INODE_SIZE);
+    int journal_start = inode_start + inode_blocks;
+    int journal_blocks = num_blocks / 64;
+    if (journal_blocks < MIN_JOURNAL_BLOCKS) journal_blocks = MIN_JOURNAL_BLOCKS;
+    if (journal_blocks > MAX_JOURNAL_BLOCKS) journal_blocks = MAX_JOURNAL_BLOCKS;
+    if (num_blocks <= 0 || (long long) journal_start + journal_blocks >= num_blocks) {
+        fprintf(stderr, "A disk of %d blocks is too small for %d inodes\n", num_blocks, num_inodes);
+        return 0;
+    }
+    int data_start = journal_start + journal_blocks;
+    int inode_size = INODE_SIZE;
+
+    /* --- Initialize: a sparse file, the blocks that are never written read as zeros
+       (an empty inode table and journal), so formatting doesn't depend on the disk size --- */
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, (off_t) num_blocks * block_size) != 0) {
+        fprintf(stderr, "Can't create the disk %s\n", path);
+        if (fd >= 0) close(fd);
+        return 0;
     }
+    close(fd);
 
-    int zero = 0;
-    memcpy(inodeBuffer, &zero, 4); // make the file size 0 for rewrite
-    writeBlock(disk, parent_dir_inode, inodeBuffer);
+    Disk* vdisk = openDisk(path, block_size, 0);
+    char* buffer;
 
-    dir_file_size -= 32;
-    writeToFile(disk, buffer, parent_dir_inode, dir_file_size); // rewrite
+    /* --- Block 0 --- */
+    buffer = (char*) calloc(block_size, 1);
+    int magic_num = LLFS_MAGIC;
+    int version = LLFS_VERSION;
+    memcpy(buffer + SB_MAGIC, &magic_num, 4);
+    memcpy(buffer + SB_NUM_BLOCKS, &num_blocks, 4);
+    memcpy(buffer + SB_NUM_INODES, &num_inodes, 4);
+    memcpy(buffer + SB_BLOCK_SIZE, &block_size, 4);
+    memcpy(buffer + SB_BITMAP_BLOCKS, &bitmap_blocks, 4);
+    memcpy(buffer + SB_INODE_START, &inode_start, 4);
+    memcpy(buffer + SB_DATA_START, &data_start, 4);
+    memcpy(buffer + SB_VERSION, &version, 4);
+    memcpy(buffer + SB_INODE_SIZE, &inode_size, 4);
+    memcpy(buffer + SB_JOURNAL_START, &journal_start, 4);
+    memcpy(buffer + SB_JOURNAL_BLOCKS, &journal_blocks, 4);
+    writeBlock(vdisk, 0, buffer);
+    free(buffer);
 
+    /* --- Empty journal, the first transaction will be number 1 --- */
+    buffer = (char*) calloc(block_size, 1);
+    journal_field(buffer, 0, JOURNAL_MAGIC);
+    journal_field(buffer, 4, J_HEADER);
+    journal_field(buffer, 8, 1);
+    writeBlock(vdisk, journal_start, buffer);
+    free(buffer);
 
+    /* --- Bitmap blocks: the superblock, the bitmap itself, the journal and the bits past the disk are never free --- */
+    long long bitmap_bits = 8LL * bitmap_blocks * block_size;
+    buffer = (char*) malloc((size_t) bitmap_blocks * block_size);
+    memset(buffer, 0xFF, (size_t) bitmap_blocks * block_size);
+    for (long long bit = 0; bit < inode_start; bit++) buffer[bit / 8] &= ~(0x80 >> (bit % 8));
+    for (long long bit = journal_start; bit < data_start; bit++) buffer[bit / 8] &= ~(0x80 >> (bit % 8));
+    for (long long bit = num_blocks; bit < bitmap_bits; bit++) buffer[bit / 8] &= ~(0x80 >> (bit % 8));
+    writeBlocks(vdisk, 1, bitmap_blocks, buffer);
     free(buffer);
-    free(inodeBuffer);
-    return inode_id;
+    closeDisk(vdisk);
+
+    /* --- Create root directory --- */
+    LLFS* fs = MountLLFS(path);
+    if (fs == NULL) return 0;
+    createFile(fs, "/", 0, NULL); // its inode_id will be ROOT_INODE
+    UnmountLLFS(fs);
+    return 1;
 }
 
-short Read(char* name, char* buffer, int size, char* path)
+int FormatLLFS(char* path, int block_size, int num_blocks, int num_inodes)
 {
-    FILE* disk = fopen(PATH_TO_VDISK, "rb+");
+    int outer = stats_enter(OP_FORMAT);
+    int rv = format_llfs(path, block_size, num_blocks, num_inodes);
+    stats_leave(outer);
+    return rv;
+}
 
-    short inode_id = find_file_inode(disk, name, path);
-    if (inode_id == 0) {
-        fprintf(stderr, "File %s doesn't exist in %s\n", name, path);
-        fclose(disk);
-        return 0;
-    }
-    readFromFile(disk, buffer, inode_id, size);
+/* --- The API on the default context (PATH_TO_VDISK, mounted on first use) --- */
 
-    fclose(disk);
-    return inode_id;
-}
+static LLFS* default_fs = NULL;
+static pthread_mutex_t default_lock = PTHREAD_MUTEX_INITIALIZER;
 
-short Write(char* name, char* data, int size, char* path)
+static void unmount_default()
 {
-    FILE* disk = fopen(PATH_TO_VDISK, "rb+");
+    UnmountLLFS(default_fs);
+    default_fs = NULL;
+}
 
-    short inode_id = find_file_inode(disk, name, path);
-    if (inode_id == 0) {
-        fprintf(stderr, "File %s doesn't exist in %s\n", name, path);
-        fclose(disk);
-        return 0;
+LLFS* default_llfs()
+{
+    static int registered = 0;
+    pthread_mutex_lock(&default_lock); // the first calls can come from several threads
+    if (default_fs == NULL) default_fs = MountLLFS(PATH_TO_VDISK);
+    if (!registered) {
+        atexit(unmount_default); // the cache is write-back
+        registered = 1;
     }
-    writeToFile(disk, data, inode_id, size);
-
-    fclose(disk);
-    return inode_id;
+    LLFS* fs = default_fs;
+    pthread_mutex_unlock(&default_lock);
+    return fs;
 }
 
-short Rmdir(char* name, char* path)
+int Read(char* name, char* buffer, int size, char* path)
 {
-    FILE* disk = fopen(PATH_TO_VDISK, "rb+");
-    short inode_id = deleteFile(disk, name, 0, path);
-    fclose(disk);
-    return inode_id;
+    LLFS* fs = default_llfs();
+    if (fs == NULL) return 0;
+    return LLFS_Read(fs, name, buffer, size, path);
 }
 
-short Rm(char* name, char* path)
+int Write(char* name, char* data, int size, char* path)
 {
-    FILE* disk = fopen(PATH_TO_VDISK, "rb+");
-    short inode_id = deleteFile(disk, name, 1, path);
-    fclose(disk);
-    return inode_id;
+    LLFS* fs = default_llfs();
+    if (fs == NULL) return 0;
+    return LLFS_Write(fs, name, data, size, path);
 }
 
-short Mkdir(char* name, char* path)
+int ReadAt(char* name, char* buffer, int size, int offset, char* path)
 {
-    FILE* disk = fopen(PATH_TO_VDISK, "rb+");
-    short inode_id = createFile(disk, name, 0, path);
-    fclose(disk);
-    return inode_id;
+    LLFS* fs = default_llfs();
+    if (fs == NULL) return 0;
+    return LLFS_ReadAt(fs, name, buffer, size, offset, path);
 }
 
-short Touch(char* name, char* path)
+int WriteAt(char* name, char* data, int size, int offset, char* path)
 {
-    FILE* disk = fopen(PATH_TO_VDISK, "rb+");
-    short inode_id = createFile(disk, name, 1, path);
-    fclose(disk);
-    return inode_id;
+    LLFS* fs = default_llfs();
+    if (fs == NULL) return 0;
+    return LLFS_WriteAt(fs, name, data, size, offset, path);
 }
 
-void InitLLFS()
+int Rmdir(char* name, char* path)
 {
-    /* --- Initialize --- */
-    FILE* disk = fopen(PATH_TO_VDISK, "wb");
-    char* init = calloc(BLOCK_SIZE * NUM_BLOCKS, 1);
-    fwrite(init, BLOCK_SIZE * NUM_BLOCKS, 1, disk);
-    free(init);
-    fclose(disk);
+    LLFS* fs = default_llfs();
+    if (fs == NULL) return 0;
+    return LLFS_Rmdir(fs, name, path);
+}
 
-    disk = fopen(PATH_TO_VDISK, "rb+");
-    char* buffer;
+int Rm(char* name, char* path)
+{
+    LLFS* fs = default_llfs();
+    if (fs == NULL) return 0;
+    return LLFS_Rm(fs, name, path);
+}
 
-    /* --- Block 0 --- */
-    buffer = (char*) malloc(BLOCK_SIZE);
-    int magic_num = 2019;
-    int num_blocks = NUM_BLOCKS;
-    int num_inodes = 126;
-    char transaction = 't'; // for filesystem recovery
-    short blockNum = 0;     // for filesystem recovery
-    memcpy(buffer + 0, &magic_num, 4);
-    memcpy(buffer + 4, &num_blocks, 4);
-    memcpy(buffer + 8, &num_inodes, 4);
-    memcpy(buffer + 12, &transaction, 1);
-    memcpy(buffer + 13, &blockNum, 2);
-    memcpy(buffer + 15, &blockNum, 2);
-    writeBlock(disk, 0, buffer);
-    free(buffer);
+int Mkdir(char* name, char* path)
+{
+    LLFS* fs = default_llfs();
+    if (fs == NULL) return 0;
+    return LLFS_Mkdir(fs, name, path);
+}
 
-    /* --- Block 1 --- */
-    buffer = (char*) malloc(BLOCK_SIZE);
-    for (int i = 0; i < BLOCK_SIZE; i++) buffer[i] = (char) 0xFF;
-    memset(buffer, 0x3F, 1); // reserved for superblock and bitmap block
-    writeBlock(disk, 1, buffer);
-    free(buffer);
+int Touch(char* name, char* path)
+{
+    LLFS* fs = default_llfs();
+    if (fs == NULL) return 0;
+    return LLFS_Touch(fs, name, path);
+}
 
-    /* --- Create root directory --- */
-    createFile(disk, "/", 0, NULL); // its inode_id will be ROOT_INODE
+int TouchMany(char** names, int count, char* path)
+{
+    LLFS* fs = default_llfs();
+    if (fs == NULL) return 0;
+    return LLFS_TouchMany(fs, names, count, path);
+}
 
-    fclose(disk);
+int RmMany(char** names, int count, char* path)
+{
+    LLFS* fs = default_llfs();
+    if (fs == NULL) return 0;
+    return LLFS_RmMany(fs, names, count, path);
 }
 
 int get_size(char* name, char* path)
 {
-    FILE* disk = fopen(PATH_TO_VDISK, "rb+");
-    short inode_id = find_file_inode(disk, name, path);
-    if (inode_id == 0) {
-        fprintf(stderr, "File %s doesn't exist in %s\n", name, path);
-        fclose(disk);
-        return 0;
-    }
-    char* inodeBuffer = (char*) malloc(BLOCK_SIZE);
-    readBlock(disk, inode_id, inodeBuffer);
-    int current_file_size;
-    memcpy(&current_file_size, inodeBuffer, 4);
-    free(inodeBuffer);
-    fclose(disk);
-    return current_file_size;
+    LLFS* fs = default_llfs();
+    if (fs == NULL) return 0;
+    return LLFS_get_size(fs, name, path);
+}
+
+int InitLLFS(int block_size, int num_blocks, int num_inodes)
+{
+    /* The default context would keep pointing at the old disk image */
+    unmount_default();
+    return FormatLLFS(PATH_TO_VDISK, block_size, num_blocks, num_inodes);
 }
@@ -1,34 +1,244 @@
 #ifndef __File_h__
 #define __File_h__
 
+#include <stdio.h>
+#include "../disk/diskIO.h"
+
 #define ROOT_INODE 2
+#define DEFAULT_NUM_INODES 1024
+#define INODE_SIZE 64      // packed, block_size / INODE_SIZE inodes per block
+#define DIR_ENTRY_SIZE 32  // 4 bytes of inode_id followed by the name
+#define MAX_NAME_LENGTH 27 // so the name and its '\0' fit in a directory entry
+#define DCACHE_SIZE 1024   // power of 2
 #define PATH_TO_VDISK "../disk/vdisk"
+#define MIN_JOURNAL_BLOCKS 16   // the journal takes 1/64 of the disk within these bounds
+#define MAX_JOURNAL_BLOCKS 1024
+#ifndef JOURNAL_BATCH
+#define JOURNAL_BATCH 64        // operations per group commit, can be overridden at build time
+#endif
+#ifndef STREAM_BUFFER
+#define STREAM_BUFFER 262144    // bytes per chunk of LLFS_ReadStream() and per read-ahead buffer of LLFS_AppendFromFd()
+#endif
+
+/* A cached path component: (directory_inode, name) -> (inode_id, type). inode_id 0
+   caches the fact that the name doesn't exist in the directory. */
+typedef struct Dentry Dentry;
+struct Dentry {
+    char         valid;
+    int          directory_inode;
+    int          inode_id;
+    int          type;
+    unsigned int hash;
+    char         name[MAX_NAME_LENGTH + 1];
+};
+
+/* One entry of a directory index, a copy of a directory entry */
+typedef struct DirSlot DirSlot;
+struct DirSlot {
+    int          inode_id; // 0 marks an empty slot
+    int          offset;   // where the entry is in the directory file
+    unsigned int hash;
+    char         name[MAX_NAME_LENGTH + 1];
+};
+
+/* In-memory hash table (linear probing) over the entries of one directory */
+typedef struct DirIndex DirIndex;
+struct DirIndex {
+    int      count;
+    int      num_slots; // power of 2, at most half full
+    DirSlot* slots;
+};
+
+/* A metadata block logged by the current transaction */
+typedef struct JournalBlock JournalBlock;
+struct JournalBlock {
+    int   blockNum;
+    char* block;
+};
+
+/* The locks of a mounted disk, defined in File.c */
+typedef struct LLFSLocks LLFSLocks;
+
+/* A mounted disk. It stays open for the whole session so that the API calls
+   don't have to fopen/fclose the disk and reread the metadata every time. */
+typedef struct LLFS LLFS;
+struct LLFS {
+    Disk* disk;
+
+    /* --- Geometry, from the superblock --- */
+    int   block_size;
+    int   num_blocks;
+    int   num_inodes;     // inode_ids go from ROOT_INODE to ROOT_INODE + num_inodes - 1
+    int   bitmap_blocks;  // the bitmap starts at block 1
+    int   inode_start;    // first inode table block
+    int   inode_blocks;
+    int   inodes_per_block;
+    int   journal_start;  // first journal block, the journal header
+    int   journal_blocks;
+    int   data_start;     // first data block
+    int   direct_ptrs;    // direct pointers in an inode, followed by a single and a double indirect one
+    int   ptrs_per_block; // pointers in an indirect block
+    int   max_file_size;
+
+    char* superblock;     // resident copy of block 0
+    char* bitmap;         // resident copy of the bitmap blocks, logged by journal_commit()
+    char* bitmap_dirty;   // per bitmap block, changed since the last commit
+    int   next_fit[2];    // where the last inode (inode map bit)/filedata (bitmap bit) search stopped
+    int   free_blocks;    // free data blocks
+    int   reserved_blocks; // free, but promised to the indirect blocks of writes in progress
+    char* inodes;         // resident inode table, INODE_SIZE bytes per inode
+    char* inode_dirty;    // by inode table block, changed since the last commit
+    char* inode_map;      // 1 for a free inode, rebuilt at mount from the in-use flags
+    unsigned long long dirty_regions; // of the inode table, changed since the last clean unmount
+    DirIndex** dir_index; // by directory inode_id, NULL until the directory is first searched
+    Dentry dcache[DCACHE_SIZE]; // direct-mapped by hash of (directory_inode, name)
+
+    /* --- The transaction being built, see journal_commit() --- */
+    int   journal_head;     // next free journal block
+    unsigned int journal_seq; // number of the next transaction
+    int   journal_limit;    // most blocks in one transaction
+    int   journal_ops;      // operations since the last commit
+    int   journal_reserved; // metadata blocks the operations in progress can still change
+    int   crash_after;      // journal writes until the disk fails, see LLFS_CrashAfter()
+    int   journal_resident; // dirty bitmap and inode table blocks
+    JournalBlock* txn;      // directory and indirect blocks, borrowed until the commit
+    int   txn_count;
+    int   max_txn;
+    int*  pending_free;     // data blocks freed by the transaction
+    int   num_pending;
+    int   max_pending;
+
+    LLFSLocks* locks;       // the API can be called from several threads
+};
+
+/* One entry of LLFS_ReadDir(), type and size are -1 unless the directory was opened with plus */
+typedef struct LLFSDirEntry LLFSDirEntry;
+struct LLFSDirEntry {
+    int  inode_id;
+    int  type; // 0 for a directory, 1 for a flat file
+    int  size;
+    char name[MAX_NAME_LENGTH + 1];
+};
+
+/* An open directory, see LLFS_OpenDir() */
+typedef struct LLFSDir LLFSDir;
+struct LLFSDir {
+    LLFS* fs;
+    char* path;
+    int   plus;   // fill in type and size
+    int   offset; // the cursor, where the next entry is in the directory file
+};
+
+/* Gets the chunks of LLFS_ReadStream() in order, returns 0 to stop */
+typedef int (*LLFSReadCallback)(void* arg, char* chunk, int length);
+
+/* A streaming append to one file, see LLFS_OpenWriter() */
+typedef struct LLFSWriter LLFSWriter;
+struct LLFSWriter {
+    LLFS*     fs;
+    char      name[MAX_NAME_LENGTH + 1];
+    char*     path;
+    long long size;     // of the file, without the buffered bytes
+    char*     buffer;   // the start of a partial block, one block
+    int       buffered;
+    int       failed;
+};
 
 // Internal library
-short find_bit_one(int c);
-short find_available_block(FILE* disk, int data_type);
-void  deallocate_block(FILE* disk, short blockNum);
-int   writeToFile(FILE* disk, char* data, short inode_id, int size);
-int   readFromFile(FILE* disk, char* data, short inode_id, int size);
-int   get_file_size(FILE* disk, short inode_id);
-short find_inode(FILE* disk, char* name, short directory_inode);
-int   is_flat_file(FILE* disk, short inode_id);
-short walk_path(FILE* disk, char* _path);
-short find_file_inode(FILE* disk, char* name, char* path);
-short find_file_inode_with_parent(FILE* disk, char* name, char* path, short* parent_dir_inode);
-int   name_collision(FILE* disk, short directory_inode, char* name);
-void  file_system_check(FILE* disk);
-short createFile(FILE* disk, char* name, int type, char* path);
-short deleteFile(FILE* disk, char* name, int type, char* path);
-
-// The API
-short Read(char* name, char* buffer, int size, char* path);
-short Write(char* name, char* data, int size, char* path);
-short Rmdir(char* name, char* path);
-short Rm(char* name, char* path);
-short Mkdir(char* name, char* path);
-short Touch(char* name, char* path);
-void  InitLLFS();
+int   find_available_block(LLFS* fs, int data_type);
+int   allocate_blocks(LLFS* fs, int n, int goal, int* blocks, int reserve);
+void  deallocate_block(LLFS* fs, int blockNum);
+int   allocate_inodes(LLFS* fs, int n, int* inode_ids);
+int   allocate_inode(LLFS* fs);
+void  free_inode(LLFS* fs, int inode_id);
+void  journal_checkpoint(LLFS* fs);
+void  journal_commit(LLFS* fs);
+void  begin_operation(LLFS* fs, int blocks, int meta);
+void  end_operation(LLFS* fs);
+int   journal_replay(LLFS* fs);
+int   bitmap_span(LLFS* fs, int n);
+int   create_meta(LLFS* fs, int n);
+int   delete_meta(LLFS* fs, int n, int blocks);
+int   write_meta(LLFS* fs, int size);
+int   inode_size(LLFS* fs, int inode_id);
+int   inode_type(LLFS* fs, int inode_id);
+int   inode_block(LLFS* fs, int inode_id, int i);
+void  set_inode_size(LLFS* fs, int inode_id, int file_size);
+void  set_inode_type(LLFS* fs, int inode_id, int file_type);
+void  set_inode_block(LLFS* fs, int inode_id, int i, int blockNum);
+int   map_blocks_needed(LLFS* fs, int old_count, int new_count);
+void  truncate_blocks(LLFS* fs, int inode_id, int old_count, int new_count);
+int   writeToFile(LLFS* fs, char* data, int inode_id, int size);
+int   readFromFile(LLFS* fs, char* data, int inode_id, int size);
+int   readFromFileAt(LLFS* fs, char* data, int inode_id, int size, int offset);
+int   writeToFileAt(LLFS* fs, char* data, int inode_id, int size, int offset);
+int   get_file_size(LLFS* fs, int inode_id);
+void  dir_index_insert(DirIndex* index, char* name, int inode_id, int offset);
+DirSlot* dir_index_lookup(DirIndex* index, char* name);
+void  dir_index_remove(DirIndex* index, char* name);
+DirIndex* get_dir_index(LLFS* fs, int directory_inode);
+void  drop_dir_index(LLFS* fs, int directory_inode);
+int   find_inode_scan(LLFS* fs, char* name, int directory_inode);
+int   find_inode(LLFS* fs, char* name, int directory_inode);
+int   is_flat_file(LLFS* fs, int inode_id);
+void  cache_dentry(LLFS* fs, char* name, int directory_inode, int inode_id, int type);
+void  invalidate_dentries(LLFS* fs, int directory_inode);
+int   lookup_dentry(LLFS* fs, char* name, int directory_inode, int* type);
+void  lock_inode(LLFS* fs, int inode_id, int exclusive);
+void  unlock_inode(LLFS* fs, int inode_id);
+int   walk_path(LLFS* fs, char* _path, int exclusive);
+int   find_file_inode(LLFS* fs, char* name, char* path, int exclusive);
+int   find_file_inode_with_parent(LLFS* fs, char* name, char* path, int* parent_dir_inode);
+int   name_collision(LLFS* fs, int directory_inode, char* name);
+int   file_system_check(LLFS* fs);
+int   check_dirty_regions(LLFS* fs);
+int   createFile(LLFS* fs, char* name, int type, char* path);
+int   deleteFile(LLFS* fs, char* name, int type, char* path);
+int   createFiles(LLFS* fs, char** names, int count, int type, char* path);
+int   deleteFiles(LLFS* fs, char** names, int count, int type, char* path);
+LLFS* default_llfs();
+
+// The API on a mounted disk
+int   FormatLLFS(char* path, int block_size, int num_blocks, int num_inodes);
+LLFS* MountLLFS(char* path);
+LLFS* MountLLFSWith(char* path, int backend); // DISK_CACHED or DISK_MMAP
+void  UnmountLLFS(LLFS* fs);
+void  AbandonLLFS(LLFS* fs);                // lets go of the disk the way a crash would
+void  LLFS_CrashAfter(LLFS* fs, int commits); // the disk fails after that many more commits
+void  LLFS_Sync(LLFS* fs);
+int   LLFS_Fsck(LLFS* fs, int repair); // returns how many problems were found
+int   LLFS_Read(LLFS* fs, char* name, char* buffer, int size, char* path);
+int   LLFS_Write(LLFS* fs, char* name, char* data, int size, char* path);
+int   LLFS_ReadAt(LLFS* fs, char* name, char* buffer, int size, int offset, char* path);
+int   LLFS_ReadStream(LLFS* fs, char* name, char* path, LLFSReadCallback callback, void* arg);
+int   LLFS_WriteAt(LLFS* fs, char* name, char* data, int size, int offset, char* path);
+int   LLFS_Rmdir(LLFS* fs, char* name, char* path);
+int   LLFS_Rm(LLFS* fs, char* name, char* path);
+int   LLFS_Mkdir(LLFS* fs, char* name, char* path);
+int   LLFS_Touch(LLFS* fs, char* name, char* path);
+int   LLFS_TouchMany(LLFS* fs, char** names, int count, char* path); // returns how many were created
+int   LLFS_RmMany(LLFS* fs, char** names, int count, char* path);    // returns how many were removed
+int   LLFS_get_size(LLFS* fs, char* name, char* path);
+LLFSDir* LLFS_OpenDir(LLFS* fs, char* path, int plus);
+int   LLFS_ReadDir(LLFSDir* dir, LLFSDirEntry* entries, int max);
+void  LLFS_CloseDir(LLFSDir* dir);
+LLFSWriter* LLFS_OpenWriter(LLFS* fs, char* name, char* path);
+int   LLFS_WriterAppend(LLFSWriter* writer, char* data, int size);
+int   LLFS_CloseWriter(LLFSWriter* writer); // writes what's left, returns 0 if any write failed
+int   LLFS_AppendFromFd(LLFS* fs, char* name, char* path, int fd);
+
+// The API (on the disk at PATH_TO_VDISK)
+int   Read(char* name, char* buffer, int size, char* path);
+int   Write(char* name, char* data, int size, char* path);
+int   ReadAt(char* name, char* buffer, int size, int offset, char* path);
+int   WriteAt(char* name, char* data, int size, int offset, char* path);
+int   Rmdir(char* name, char* path);
+int   Rm(char* name, char* path);
+int   Mkdir(char* name, char* path);
+int   Touch(char* name, char* path);
+int   TouchMany(char** names, int count, char* path);
+int   RmMany(char** names, int count, char* path);
+int   InitLLFS(int block_size, int num_blocks, int num_inodes);
 int   get_size(char* name, char* path);
 
 #endif
@@ -0,0 +1,148 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "stats.h"
+
+_Thread_local StatsBlock* stats_local = NULL;
+_Thread_local int stats_op = OP_OTHER;
+static _Thread_local long long last_end = -1; // where the thread's last transfer ended
+
+const char* stats_names[NUM_STATS] = {
+    "calls", "block_reads", "block_writes", "bytes_read", "bytes_written", "seeks",
+    "cache_hits", "allocs", "dir_scans", "path_components", "dcache_misses", "commits"
+};
+const char* stats_op_names[NUM_OPS] = {
+    "other", "format", "mount", "sync", "read", "read_at", "read_stream", "write",
+    "write_at", "append", "touch", "rm", "mkdir", "rmdir", "get_size", "readdir", "fsck"
+};
+
+/* --- Every thread's block, blocks of threads that exited are given to new ones --- */
+
+static pthread_mutex_t registry = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_exit;
+static StatsBlock* blocks = NULL;
+static StatsBlock* free_blocks = NULL;
+static long baseline[NUM_OPS][NUM_STATS]; // the totals at the last stats_reset()
+
+static void release_block(void* block)
+{
+    pthread_mutex_lock(&registry);
+    ((StatsBlock*) block)->next_free = free_blocks;
+    free_blocks = (StatsBlock*) block;
+    pthread_mutex_unlock(&registry);
+}
+
+static void make_key()
+{
+    pthread_key_create(&thread_exit, release_block);
+}
+
+void stats_register()
+{
+    /* Gives the thread a block, its counts keep adding up to the totals after it exits */
+    pthread_once(&once, make_key);
+    pthread_mutex_lock(&registry);
+    StatsBlock* block = free_blocks;
+    if (block != NULL) free_blocks = block->next_free;
+    else {
+        block = (StatsBlock*) calloc(1, sizeof(StatsBlock));
+        block->next = blocks;
+        blocks = block;
+    }
+    pthread_mutex_unlock(&registry);
+    pthread_setspecific(thread_exit, block);
+    stats_local = block;
+}
+
+/* --- Counting --- */
+
+int stats_enter(int op)
+{
+    /* Counts the calls of an API entry point, what it does is counted for it until
+       stats_leave(). A call made by another entry point is counted for the outer one. */
+    int outer = stats_op;
+    if (outer == OP_OTHER) stats_op = op;
+    stats_add(STAT_CALLS, outer == OP_OTHER);
+    return outer;
+}
+
+void stats_leave(int outer)
+{
+    stats_op = outer;
+}
+
+void stats_transfer(int write, long long offset, long long length, int block_size)
+{
+    /* A transfer between memory and the vdisk */
+    stats_add(write ? STAT_BLOCK_WRITES : STAT_BLOCK_READS, (length + block_size - 1) / block_size);
+    stats_add(write ? STAT_BYTES_WRITTEN : STAT_BYTES_READ, length);
+    if (offset != last_end) stats_add(STAT_SEEKS, 1);
+    last_end = offset + length;
+}
+
+/* --- Reading them --- */
+
+static void sum_blocks(long totals[NUM_OPS][NUM_STATS])
+{
+    memset(totals, 0, sizeof(long) * NUM_OPS * NUM_STATS);
+    for (StatsBlock* block = blocks; block != NULL; block = block->next) {
+        for (int op = 0; op < NUM_OPS; op++) {
+            for (int s = 0; s < NUM_STATS; s++) {
+                totals[op][s] += atomic_load_explicit(&block->counts[op][s], memory_order_relaxed);
+            }
+        }
+    }
+}
+
+void stats_get(long totals[NUM_OPS][NUM_STATS])
+{
+    /* Everything counted by every thread since the last stats_reset() */
+    pthread_mutex_lock(&registry);
+    sum_blocks(totals);
+    for (int op = 0; op < NUM_OPS; op++) {
+        for (int s = 0; s < NUM_STATS; s++) totals[op][s] -= baseline[op][s];
+    }
+    pthread_mutex_unlock(&registry);
+}
+
+void stats_reset()
+{
+    /* The threads' counters aren't touched (only their thread writes them), the totals
+       start over from what they are now */
+    pthread_mutex_lock(&registry);
+    sum_blocks(baseline);
+    pthread_mutex_unlock(&registry);
+}
+
+void stats_print(FILE* out, int json)
+{
+    /* One line (or JSON object) per entry point that counted something */
+    long totals[NUM_OPS][NUM_STATS];
+    stats_get(totals);
+    if (!json) {
+        fprintf(out, "%-12s", "op");
+        for (int s = 0; s < NUM_STATS; s++) fprintf(out, " %*s", (int) strlen(stats_names[s]), stats_names[s]);
+        fprintf(out, "\n");
+    } else fprintf(out, "{");
+
+    int first = 1;
+    for (int op = 0; op < NUM_OPS; op++) {
+        int used = 0;
+        for (int s = 0; s < NUM_STATS; s++) used |= totals[op][s] != 0;
+        if (!used) continue;
+        if (!json) {
+            fprintf(out, "%-12s", stats_op_names[op]);
+            for (int s = 0; s < NUM_STATS; s++) fprintf(out, " %*ld", (int) strlen(stats_names[s]), totals[op][s]);
+            fprintf(out, "\n");
+        } else {
+            fprintf(out, "%s\n  \"%s\": {", first ? "" : ",", stats_op_names[op]);
+            for (int s = 0; s < NUM_STATS; s++) fprintf(out, "%s\"%s\": %ld", s ? ", " : "", stats_names[s], totals[op][s]);
+            fprintf(out, "}");
+        }
+        first = 0;
+    }
+    if (json) fprintf(out, "%s}\n", first ? "" : "\n");
+}
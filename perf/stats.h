@@ -0,0 +1,82 @@
+#ifndef __stats_h__
+#define __stats_h__
+
+#include <stdio.h>
+#include <stdatomic.h>
+
+#ifndef LLFS_STATS
+#define LLFS_STATS 1 // 0 compiles the counters out
+#endif
+
+/* What is counted */
+enum {
+    STAT_CALLS,           // calls of the entry point
+    STAT_BLOCK_READS,     // blocks read from the vdisk
+    STAT_BLOCK_WRITES,    // blocks written to the vdisk
+    STAT_BYTES_READ,
+    STAT_BYTES_WRITTEN,
+    STAT_SEEKS,           // transfers that don't start where the thread's previous one ended
+    STAT_CACHE_HITS,      // blocks found in the block cache
+    STAT_ALLOCS,          // allocator calls, for blocks or inodes, taking or freeing them
+    STAT_DIR_SCANS,       // directories read entry by entry (index builds and linear scans)
+    STAT_PATH_COMPONENTS, // path components walked
+    STAT_DCACHE_MISSES,   // path components that weren't in the dentry cache
+    STAT_COMMITS,         // journal commits
+    NUM_STATS
+};
+
+/* Whom it's counted for: the API entry point the thread is in (the outermost one) */
+enum {
+    OP_OTHER,
+    OP_FORMAT,
+    OP_MOUNT,
+    OP_SYNC,
+    OP_READ,
+    OP_READ_AT,
+    OP_READ_STREAM,
+    OP_WRITE,
+    OP_WRITE_AT,
+    OP_APPEND,
+    OP_TOUCH,
+    OP_RM,
+    OP_MKDIR,
+    OP_RMDIR,
+    OP_GET_SIZE,
+    OP_READDIR,
+    OP_FSCK,
+    NUM_OPS
+};
+
+/* The counters of one thread. Only that thread changes them (relaxed atomics, so they
+   cost a plain add), stats_get() adds up the ones of every thread. */
+typedef struct StatsBlock StatsBlock;
+struct StatsBlock {
+    _Atomic long counts[NUM_OPS][NUM_STATS];
+    StatsBlock*  next; // every block ever used
+    StatsBlock*  next_free;
+};
+
+extern _Thread_local StatsBlock* stats_local; // NULL until the thread counts something
+extern _Thread_local int stats_op;
+
+extern const char* stats_names[NUM_STATS];
+extern const char* stats_op_names[NUM_OPS];
+
+void stats_register();
+int  stats_enter(int op);
+void stats_leave(int outer);
+void stats_transfer(int write, long long offset, long long length, int block_size);
+void stats_get(long totals[NUM_OPS][NUM_STATS]);
+void stats_reset();
+void stats_print(FILE* out, int json);
+
+static inline void stats_add(int stat, long n)
+{
+#if LLFS_STATS
+    if (stats_local == NULL) stats_register();
+    _Atomic long* counter = &stats_local->counts[stats_op][stat];
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+#endif
+}
+
+#endif
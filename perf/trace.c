@@ -0,0 +1,94 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <time.h>
+#include "trace.h"
+
+/* One finished span. The fields are written by one thread and can be read by
+   trace_dump() meanwhile: seq is the number of the event + 1 once it's complete,
+   0 while it's being written (a seqlock, a slot that changed under the reader
+   is skipped). */
+typedef struct TraceEvent TraceEvent;
+struct TraceEvent {
+    atomic_ulong            seq;
+    const char* _Atomic     name;
+    atomic_llong            start;    // ns, CLOCK_MONOTONIC
+    atomic_llong            duration; // ns
+    atomic_int              tid;
+};
+
+atomic_int trace_enabled = 0;
+static TraceEvent ring[TRACE_EVENTS];
+static atomic_ulong head = 0;        // number of the next event
+static atomic_ulong first = 0;       // number of the first event since trace_start()
+static atomic_int next_tid = 1;
+static _Thread_local int tid = 0;    // a small number per thread, for the viewer
+
+long long trace_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void trace_record(const char* name, long long start)
+{
+    /* Lock-free: the slot is taken with one fetch_add, the oldest event is overwritten */
+    long long end = trace_now();
+    if (tid == 0) tid = atomic_fetch_add_explicit(&next_tid, 1, memory_order_relaxed);
+    unsigned long n = atomic_fetch_add_explicit(&head, 1, memory_order_relaxed);
+    TraceEvent* event = &ring[n & (TRACE_EVENTS - 1)];
+
+    atomic_store_explicit(&event->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&event->name, name, memory_order_relaxed);
+    atomic_store_explicit(&event->start, start, memory_order_relaxed);
+    atomic_store_explicit(&event->duration, end - start, memory_order_relaxed);
+    atomic_store_explicit(&event->tid, tid, memory_order_relaxed);
+    atomic_store_explicit(&event->seq, n + 1, memory_order_release);
+}
+
+void trace_start()
+{
+    /* Only the spans from now on are dumped */
+    atomic_store(&first, atomic_load(&head));
+    atomic_store(&trace_enabled, 1);
+}
+
+void trace_stop()
+{
+    atomic_store(&trace_enabled, 0);
+}
+
+int trace_dump(char* path)
+{
+    /* Writes the spans still in the ring as Chrome trace events (JSON, "X" events with
+       the times in microseconds), for chrome://tracing or Perfetto. Returns how many. */
+    FILE* out = fopen(path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Can't open %s\n", path);
+        return -1;
+    }
+    unsigned long end = atomic_load(&head);
+    unsigned long begin = atomic_load(&first);
+    if (end - begin > TRACE_EVENTS) begin = end - TRACE_EVENTS;
+
+    int count = 0;
+    fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+    for (unsigned long n = begin; n < end; n++) {
+        TraceEvent* event = &ring[n & (TRACE_EVENTS - 1)];
+        if (atomic_load_explicit(&event->seq, memory_order_acquire) != n + 1) continue;
+        const char* name = atomic_load_explicit(&event->name, memory_order_relaxed);
+        long long start = atomic_load_explicit(&event->start, memory_order_relaxed);
+        long long duration = atomic_load_explicit(&event->duration, memory_order_relaxed);
+        int event_tid = atomic_load_explicit(&event->tid, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&event->seq, memory_order_relaxed) != n + 1) continue; // overwritten meanwhile
+
+        fprintf(out, "%s\n  {\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                count ? "," : "", name, event_tid, start / 1000.0, duration / 1000.0);
+        count++;
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+    return count;
+}
@@ -0,0 +1,47 @@
+#ifndef __trace_h__
+#define __trace_h__
+
+#include <stdatomic.h>
+
+#ifndef LLFS_TRACE
+#define LLFS_TRACE 1          // 0 compiles the spans out
+#endif
+#ifndef TRACE_EVENTS
+#define TRACE_EVENTS 65536    // power of 2, the ring keeps the latest ones
+#endif
+
+/* A span of time spent in a function, taken with
+       long long span = TRACE_BEGIN();
+       ...
+       TRACE_END("name", span);
+   While tracing is stopped TRACE_BEGIN() gives 0 and TRACE_END() records nothing, a span
+   that isn't ended (an early return on an error) isn't recorded either. name has to be
+   a string literal, only the pointer is kept. */
+
+extern atomic_int trace_enabled;
+
+long long trace_now();
+void trace_record(const char* name, long long start);
+void trace_start();
+void trace_stop();
+int  trace_dump(char* path);
+
+static inline long long trace_begin()
+{
+    return atomic_load_explicit(&trace_enabled, memory_order_relaxed) ? trace_now() : 0;
+}
+
+static inline void trace_end(const char* name, long long start)
+{
+    if (start != 0) trace_record(name, start);
+}
+
+#if LLFS_TRACE
+#define TRACE_BEGIN()          trace_begin()
+#define TRACE_END(name, start) trace_end(name, start)
+#else
+#define TRACE_BEGIN()          0
+#define TRACE_END(name, start) ((void) (start))
+#endif
+
+#endif